@@ -0,0 +1,333 @@
+#include <benchmark/benchmark.h>
+#include "src/search_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+
+// SearchTree in each traversal order against std::set. Every benchmark is registered on its own
+// as operation/container/key/distribution/size, e.g. find/in_order/string/zipfian/1000000, so
+// --benchmark_filter picks a slice; the full matrix up to ten million keys takes a long while.
+// The trees are red-black: without balancing the sorted inputs would make the big sizes quadratic.
+
+namespace {
+
+enum class distribution {
+    random,
+    sorted,
+    zipfian
+};
+
+
+constexpr std::uint64_t seed = 0x5eed;
+
+constexpr std::size_t sizes[] = { 1'000, 10'000, 100'000, 1'000'000, 10'000'000 };
+
+
+// Gray et al.'s generator as used by YCSB: rank 0 is the most popular, theta close to 1 gives the
+// usual heavy skew; zeta(n) is summed once per generator
+class zipfian_generator {
+public:
+    explicit zipfian_generator(std::uint64_t n, double theta = 0.99)
+        : n_(n), theta_(theta), alpha_(1 / (1 - theta)), zeta_n_(0) {
+        for (std::uint64_t i = 1; i <= n; ++i) {
+            zeta_n_ += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        double zeta_2 = 1 + 1 / std::pow(2.0, theta);
+        eta_ = (1 - std::pow(2.0 / static_cast<double>(n), 1 - theta)) / (1 - zeta_2 / zeta_n_);
+    }
+
+    template <typename gen_t>
+    std::uint64_t operator ()(gen_t& gen) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(gen);
+        double uz = u * zeta_n_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        auto rank = static_cast<std::uint64_t>(static_cast<double>(n_) * std::pow(eta_ * u - eta_ + 1, alpha_));
+
+        return std::min(rank, n_ - 1);
+    }
+
+private:
+    std::uint64_t n_;
+    double theta_;
+    double alpha_;
+    double zeta_n_;
+    double eta_;
+};
+
+
+// every id below n in the order of the distribution; zipfian draws n ids instead, scattered so
+// the popular ones do not all sit at one end of the tree
+std::vector<std::uint64_t> make_ids(std::size_t n, distribution dist, std::uint64_t salt) {
+    std::vector<std::uint64_t> ids(n);
+    std::mt19937_64 gen(seed ^ salt);
+    if (dist == distribution::zipfian) {
+        zipfian_generator zipf(n);
+        for (std::uint64_t& id : ids) {
+            id = zipf(gen) * 0x9e3779b97f4a7c15ull % n;
+        }
+
+        return ids;
+    }
+
+    std::iota(ids.begin(), ids.end(), std::uint64_t(0));
+    if (dist == distribution::random) {
+        std::shuffle(ids.begin(), ids.end(), gen);
+    }
+
+    return ids;
+}
+
+
+template <typename Key>
+Key make_key(std::uint64_t id);
+
+template <>
+int make_key<int>(std::uint64_t id) {
+    return static_cast<int>(id);
+}
+
+// zero padded so the strings sort like the ids, short enough to stay in the small buffer
+template <>
+std::string make_key<std::string>(std::uint64_t id) {
+    std::string digits = std::to_string(id);
+
+    return std::string(12 - digits.size(), '0') + digits;
+}
+
+
+template <typename Key>
+struct workload {
+    std::size_t size;
+    distribution dist;
+    // inserted into a fresh container, in this order
+    std::vector<Key> inserted;
+    // looked up or erased, drawn from the same distribution
+    std::vector<Key> queried;
+};
+
+
+// benchmarks are registered so that runs sharing a workload follow each other, so only the
+// latest one is kept; the ten million string keys would not fit many times over
+template <typename Key>
+const workload<Key>& get_workload(std::size_t n, distribution dist) {
+    static workload<Key> cached{ 0, distribution::random, {}, {} };
+    if (cached.size != n || cached.dist != dist || cached.inserted.empty()) {
+        cached = { n, dist, {}, {} };
+        cached.inserted.reserve(n);
+        for (std::uint64_t id : make_ids(n, dist, 1)) {
+            cached.inserted.push_back(make_key<Key>(id));
+        }
+        cached.queried.reserve(n);
+        for (std::uint64_t id : make_ids(n, dist, 2)) {
+            cached.queried.push_back(make_key<Key>(id));
+        }
+    }
+
+    return cached;
+}
+
+
+template <
+    typename Set,
+    typename Key
+>
+Set build(const workload<Key>& load) {
+    Set set;
+    for (const Key& key : load.inserted) {
+        set.insert(key);
+    }
+
+    return set;
+}
+
+
+// the container is torn down outside the timed region, as are the copies erase works on
+template <
+    typename Set,
+    typename Key
+>
+void bench_insert(benchmark::State& state, std::size_t n, distribution dist) {
+    const workload<Key>& load = get_workload<Key>(n, dist);
+    for (auto _ : state) {
+        Set set;
+        for (const Key& key : load.inserted) {
+            set.insert(key);
+        }
+        benchmark::DoNotOptimize(set.size());
+        state.PauseTiming();
+        set.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * load.inserted.size());
+}
+
+
+template <
+    typename Set,
+    typename Key
+>
+void bench_find(benchmark::State& state, std::size_t n, distribution dist) {
+    const workload<Key>& load = get_workload<Key>(n, dist);
+    const Set set = build<Set>(load);
+    for (auto _ : state) {
+        for (const Key& key : load.queried) {
+            benchmark::DoNotOptimize(set.find(key));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * load.queried.size());
+}
+
+
+template <
+    typename Set,
+    typename Key
+>
+void bench_lower_bound(benchmark::State& state, std::size_t n, distribution dist) {
+    const workload<Key>& load = get_workload<Key>(n, dist);
+    const Set set = build<Set>(load);
+    for (auto _ : state) {
+        for (const Key& key : load.queried) {
+            benchmark::DoNotOptimize(set.lower_bound(key));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * load.queried.size());
+}
+
+
+template <
+    typename Set,
+    typename Key
+>
+void bench_erase(benchmark::State& state, std::size_t n, distribution dist) {
+    const workload<Key>& load = get_workload<Key>(n, dist);
+    const Set source = build<Set>(load);
+    for (auto _ : state) {
+        state.PauseTiming();
+        Set set = source;
+        state.ResumeTiming();
+        for (const Key& key : load.queried) {
+            benchmark::DoNotOptimize(set.erase(key));
+        }
+        state.PauseTiming();
+        set.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * load.queried.size());
+}
+
+
+template <
+    typename Set,
+    typename Key
+>
+void bench_copy(benchmark::State& state, std::size_t n, distribution dist) {
+    const workload<Key>& load = get_workload<Key>(n, dist);
+    const Set source = build<Set>(load);
+    for (auto _ : state) {
+        Set set = source;
+        benchmark::DoNotOptimize(set.size());
+        state.PauseTiming();
+        set.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * source.size());
+}
+
+
+template <
+    typename Set,
+    typename Key
+>
+void bench_traversal(benchmark::State& state, std::size_t n, distribution dist) {
+    const workload<Key>& load = get_workload<Key>(n, dist);
+    // SearchTree only iterates through a non-const object
+    Set set = build<Set>(load);
+    for (auto _ : state) {
+        for (const Key& key : set) {
+            benchmark::DoNotOptimize(&key);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * set.size());
+}
+
+
+template <
+    typename Key,
+    traversalTag Tag
+>
+using tree_t = SearchTree<Key, Tag, std::less<Key>, std::allocator<Node<Key>>, red_black_tag>;
+
+
+const char* name_of(distribution dist) {
+    switch (dist) {
+        case distribution::random:
+            return "random";
+        case distribution::sorted:
+            return "sorted";
+        default:
+            return "zipfian";
+    }
+}
+
+
+template <typename Set>
+void register_operations(const std::string& container, const std::string& suffix, std::size_t n, distribution dist) {
+    using key_t = typename Set::value_type;
+
+    auto add = [&](const std::string& operation, void (*func)(benchmark::State&, std::size_t, distribution)) {
+        std::string name = operation + "/" + container + "/" + suffix;
+        benchmark::RegisterBenchmark(name.c_str(), func, n, dist)
+            ->Unit(benchmark::kMillisecond);
+    };
+    add("insert", &bench_insert<Set, key_t>);
+    add("find", &bench_find<Set, key_t>);
+    add("lower_bound", &bench_lower_bound<Set, key_t>);
+    add("erase", &bench_erase<Set, key_t>);
+    add("copy", &bench_copy<Set, key_t>);
+    add("traversal", &bench_traversal<Set, key_t>);
+}
+
+
+template <typename Key>
+void register_key(const std::string& key_name) {
+    for (distribution dist : { distribution::random, distribution::sorted, distribution::zipfian }) {
+        for (std::size_t n : sizes) {
+            std::string suffix = key_name + "/" + name_of(dist) + "/" + std::to_string(n);
+            register_operations<std::set<Key>>("std_set", suffix, n, dist);
+            register_operations<tree_t<Key, in_order_tag>>("in_order", suffix, n, dist);
+            register_operations<tree_t<Key, pre_order_tag>>("pre_order", suffix, n, dist);
+            register_operations<tree_t<Key, post_order_tag>>("post_order", suffix, n, dist);
+        }
+    }
+}
+
+}
+
+
+int main(int argc, char** argv) {
+    register_key<int>("int");
+    register_key<std::string>("string");
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
@@ -0,0 +1,923 @@
+#pragma once
+
+#include "iterator.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+
+
+// keys of a node plus its header fill two cache lines, an odd count keeps splits symmetric
+template <typename T>
+constexpr std::size_t btree_capacity() {
+    std::size_t capacity = std::max<std::size_t>(3, (128 - 16) / sizeof(T));
+    return capacity % 2 ? capacity : capacity - 1;
+}
+
+
+template <
+    typename T,
+    std::size_t Capacity
+>
+struct alignas(64) BTreeNode {
+    static constexpr std::size_t capacity = Capacity;
+
+    BTreeNode* par = nullptr;
+    std::uint16_t pos = 0;
+    std::uint16_t count = 0;
+    bool leaf = true;
+    alignas(T) unsigned char storage[sizeof(T) * Capacity];
+
+    T* keys() {
+        return std::launder(reinterpret_cast<T*>(storage));
+    }
+
+    const T* keys() const {
+        return std::launder(reinterpret_cast<const T*>(storage));
+    }
+
+    T& key(std::size_t index) {
+        return keys()[index];
+    }
+
+    const T& key(std::size_t index) const {
+        return keys()[index];
+    }
+};
+
+
+template <
+    typename T,
+    std::size_t Capacity
+>
+struct BTreeInnerNode : BTreeNode<T, Capacity> {
+    BTreeNode<T, Capacity>* child[Capacity + 1];
+};
+
+
+template<
+    typename T,
+    traversalTag Tag,
+    typename node_t
+>
+class BTreeIterator {
+    template <typename, traversalTag, typename, typename, std::size_t>
+    friend class BTree;
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+
+private:
+    using inner_t = BTreeInnerNode<std::remove_const_t<T>, node_t::capacity>;
+
+public:
+    BTreeIterator() : node_(nullptr), index_(0), root_(nullptr) {}
+
+    reference operator *() const {
+        return node_->key(index_);
+    }
+    pointer operator ->() const {
+        return &node_->key(index_);
+    }
+
+    bool operator ==(const BTreeIterator& arg) const {
+        return node_ == arg.node_ && (!node_ || index_ == arg.index_);
+    }
+    bool operator !=(const BTreeIterator& arg) const {
+        return !operator==(arg);
+    }
+
+public:
+    BTreeIterator& operator ++() {
+        if (!node_) {
+            set_first(*root_);
+        }
+        else {
+            increase();
+        }
+
+        return *this;
+    }
+    BTreeIterator operator ++(int) {
+        BTreeIterator temp = *this;
+        ++*this;
+
+        return temp;
+    }
+
+    BTreeIterator& operator --() {
+        if (!node_) {
+            set_last(*root_);
+        }
+        else {
+            decrease();
+        }
+
+        return *this;
+    }
+    BTreeIterator operator --(int) {
+        BTreeIterator temp = *this;
+        --*this;
+
+        return temp;
+    }
+
+private:
+    BTreeIterator(node_t* node, std::size_t index, node_t* const* root)
+        : node_(node), index_(index), root_(root) {
+    }
+
+    static node_t* child_at(node_t* node, std::size_t index) {
+        return static_cast<inner_t*>(node)->child[index];
+    }
+
+    void set_first(node_t* root) {
+        node_ = root;
+        index_ = 0;
+        if (!node_ || std::is_same_v<Tag, pre_order_tag>) {
+            return;
+        }
+        while (!node_->leaf) {
+            node_ = child_at(node_, 0);
+        }
+    }
+
+    void set_last(node_t* root) {
+        node_ = root;
+        if (!node_) {
+            return;
+        }
+        if constexpr (!std::is_same_v<Tag, post_order_tag>) {
+            while (!node_->leaf) {
+                node_ = child_at(node_, node_->count);
+            }
+        }
+        index_ = node_->count - 1;
+    }
+
+    void increase() {
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            if (!node_->leaf) {
+                node_ = child_at(node_, index_ + 1);
+                while (!node_->leaf) {
+                    node_ = child_at(node_, 0);
+                }
+                index_ = 0;
+            }
+            else if (index_ + 1 < node_->count) {
+                ++index_;
+            }
+            else {
+                while (node_->par && node_->pos == node_->par->count) {
+                    node_ = node_->par;
+                }
+                index_ = node_->pos;
+                node_ = node_->par;
+            }
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            if (index_ + 1 < node_->count) {
+                ++index_;
+            }
+            else if (!node_->leaf) {
+                node_ = child_at(node_, 0);
+                index_ = 0;
+            }
+            else {
+                while (node_->par && node_->pos == node_->par->count) {
+                    node_ = node_->par;
+                }
+                if (node_->par) {
+                    node_ = child_at(node_->par, node_->pos + 1);
+                }
+                else {
+                    node_ = nullptr;
+                }
+                index_ = 0;
+            }
+        }
+        else if constexpr (std::is_same_v<Tag, post_order_tag>) {
+            if (index_ + 1 < node_->count) {
+                ++index_;
+            }
+            else if (!node_->par) {
+                node_ = nullptr;
+            }
+            else if (node_->pos < node_->par->count) {
+                set_first(child_at(node_->par, node_->pos + 1));
+            }
+            else {
+                node_ = node_->par;
+                index_ = 0;
+            }
+        }
+    }
+
+    void decrease() {
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            if (!node_->leaf) {
+                node_ = child_at(node_, index_);
+                while (!node_->leaf) {
+                    node_ = child_at(node_, node_->count);
+                }
+                index_ = node_->count - 1;
+            }
+            else if (index_ > 0) {
+                --index_;
+            }
+            else {
+                while (node_->par && node_->pos == 0) {
+                    node_ = node_->par;
+                }
+                index_ = node_->pos - 1;
+                node_ = node_->par;
+            }
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            if (index_ > 0) {
+                --index_;
+            }
+            else if (!node_->par) {
+                node_ = nullptr;
+            }
+            else if (node_->pos > 0) {
+                set_last(child_at(node_->par, node_->pos - 1));
+            }
+            else {
+                node_ = node_->par;
+                index_ = node_->count - 1;
+            }
+        }
+        else if constexpr (std::is_same_v<Tag, post_order_tag>) {
+            if (index_ > 0) {
+                --index_;
+            }
+            else if (!node_->leaf) {
+                node_ = child_at(node_, node_->count);
+                index_ = node_->count - 1;
+            }
+            else {
+                while (node_->par && node_->pos == 0) {
+                    node_ = node_->par;
+                }
+                if (node_->par) {
+                    node_ = child_at(node_->par, node_->pos - 1);
+                    index_ = node_->count - 1;
+                }
+                else {
+                    node_ = nullptr;
+                }
+            }
+        }
+    }
+
+private:
+    node_t* node_;
+    std::size_t index_;
+    node_t* const* root_;
+};
+
+
+// B-tree with the SearchTree interface: Capacity sorted keys per node, so a lookup touches
+// one or two cache lines per level instead of one per binary level
+template <
+    typename T,
+    traversalTag Tag,
+    typename Comp = std::less<T>,
+    typename Allocator = std::allocator<T>,
+    std::size_t Capacity = btree_capacity<T>()
+>
+class BTree {
+    static_assert(Capacity >= 3 && Capacity % 2 == 1, "B-tree capacity must be odd and at least 3");
+private:
+    using node_t = BTreeNode<T, Capacity>;
+    using inner_t = BTreeInnerNode<T, Capacity>;
+public:
+    using value_type = T;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using pointer = value_type*;
+    using const_pointer = const value_type*;
+    using iterator = BTreeIterator<const T, Tag, node_t>;
+    using const_iterator = BTreeIterator<const T, Tag, node_t>;
+    using difference_type = std::ptrdiff_t;
+    using size_type = std::size_t;
+
+    using key_type = T;
+    using key_compare = Comp;
+    using value_compare = Comp;
+
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    using allocator_type = Allocator;
+
+private:
+    using leaf_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<node_t>;
+    using inner_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<inner_t>;
+    using leaf_traits_type = std::allocator_traits<leaf_allocator_type>;
+    using inner_traits_type = std::allocator_traits<inner_allocator_type>;
+
+    static constexpr size_type max_keys = Capacity;
+    static constexpr size_type min_keys = Capacity / 2;
+
+    enum class erase_mode {
+        by_key,
+        max,
+        min
+    };
+
+private:
+    node_t* root_;
+    key_compare comp_;
+    allocator_type alloc_;
+    leaf_allocator_type leaf_alloc_;
+    inner_allocator_type inner_alloc_;
+    size_type size_;
+
+public:
+    BTree()
+        : root_(nullptr), comp_(Comp()), alloc_(Allocator()), leaf_alloc_(alloc_), inner_alloc_(alloc_), size_(0) {}
+
+    template <
+        std::input_iterator input_iter_t
+    >
+    BTree(input_iter_t lhs, input_iter_t rhs)
+        : BTree() {
+        insert(lhs, rhs);
+    }
+
+    BTree(const BTree& other)
+        : root_(nullptr), comp_(other.comp_),
+          alloc_(std::allocator_traits<Allocator>::select_on_container_copy_construction(other.alloc_)),
+          leaf_alloc_(alloc_), inner_alloc_(alloc_), size_(other.size_) {
+        root_ = copy(other.root_, nullptr);
+    }
+
+    BTree(BTree&& other) noexcept
+        : root_(other.root_), comp_(other.comp_), alloc_(other.alloc_),
+          leaf_alloc_(other.leaf_alloc_), inner_alloc_(other.inner_alloc_), size_(other.size_) {
+        other.root_ = nullptr;
+        other.size_ = 0;
+    }
+
+    BTree& operator =(const BTree& other) {
+        if (this == &other) {
+            return *this;
+        }
+        clear();
+        root_ = copy(other.root_, nullptr);
+        comp_ = other.comp_;
+        size_ = other.size_;
+
+        return *this;
+    }
+
+    BTree& operator =(BTree&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        clear();
+        swap(other);
+
+        return *this;
+    }
+
+    ~BTree() {
+        clear();
+    }
+
+
+    iterator begin() const {
+        iterator out(nullptr, 0, &root_);
+        out.set_first(root_);
+
+        return out;
+    }
+
+    iterator end() const {
+        return iterator(nullptr, 0, &root_);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    reverse_iterator rbegin() const {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const {
+        return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator crbegin() const {
+        return rbegin();
+    }
+
+    const_reverse_iterator crend() const {
+        return rend();
+    }
+
+
+    bool operator ==(const BTree& other) const {
+        return size_ == other.size_ && std::equal(begin(), end(), other.begin());
+    }
+
+    bool operator !=(const BTree& other) const {
+        return !operator==(other);
+    }
+
+
+    void swap(BTree& other) {
+        std::swap(root_, other.root_);
+        std::swap(comp_, other.comp_);
+        std::swap(alloc_, other.alloc_);
+        std::swap(leaf_alloc_, other.leaf_alloc_);
+        std::swap(inner_alloc_, other.inner_alloc_);
+        std::swap(size_, other.size_);
+    }
+
+    size_type size() const {
+        return size_;
+    }
+
+    size_type max_size() const {
+        return leaf_traits_type::max_size(leaf_alloc_) * min_keys;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    key_compare key_comp() const {
+        return comp_;
+    }
+
+    value_compare value_comp() const {
+        return comp_;
+    }
+
+    allocator_type get_allocator() const {
+        return alloc_;
+    }
+
+
+    std::pair<iterator, bool> insert(const value_type& value) {
+        return insert_unique(value);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return insert_unique(std::move(value));
+    }
+
+    template <
+        typename input_iter_t
+    >
+    void insert(input_iter_t lhs, input_iter_t rhs) {
+        while (lhs != rhs) {
+            insert(*lhs);
+            ++lhs;
+        }
+    }
+
+    template <
+        typename... Args
+    >
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert_unique(value_type(std::forward<Args>(args)...));
+    }
+
+    size_type erase(const value_type& value) {
+        if (!find(value).node_) {
+            return 0;
+        }
+        // value may live in the tree itself, and the descent shifts keys around under it
+        value_type key = value;
+        erase_key(key);
+
+        return 1;
+    }
+
+    // keys move between nodes while the tree rebalances, so the key is copied out first and the
+    // successor is looked up again
+    iterator erase(iterator pos) {
+        iterator next = pos;
+        ++next;
+        value_type key = *pos;
+        if (!next.node_) {
+            erase_key(key);
+            return end();
+        }
+        value_type next_value = *next;
+        erase_key(key);
+
+        return find(next_value);
+    }
+
+    void erase(iterator lhs, iterator rhs) {
+        while (lhs != rhs) {
+            lhs = erase(lhs);
+        }
+    }
+
+    void clear() {
+        delete_tree(root_);
+        root_ = nullptr;
+        size_ = 0;
+    }
+
+
+    iterator find(const value_type& value) const {
+        node_t* node = root_;
+        while (node) {
+            size_type index = lower_index(node, value);
+            if (index < node->count && !comp_(value, node->key(index))) {
+                return iterator(node, index, &root_);
+            }
+            if (node->leaf) {
+                break;
+            }
+            node = child_at(node, index);
+        }
+
+        return end();
+    }
+
+    iterator lower_bound(const value_type& value) const {
+        iterator out = end();
+        node_t* node = root_;
+        while (node) {
+            size_type index = lower_index(node, value);
+            if (index < node->count) {
+                out = iterator(node, index, &root_);
+            }
+            if (node->leaf) {
+                break;
+            }
+            node = child_at(node, index);
+        }
+
+        return out;
+    }
+
+    iterator upper_bound(const value_type& value) const {
+        iterator out = end();
+        node_t* node = root_;
+        while (node) {
+            size_type index = upper_index(node, value);
+            if (index < node->count) {
+                out = iterator(node, index, &root_);
+            }
+            if (node->leaf) {
+                break;
+            }
+            node = child_at(node, index);
+        }
+
+        return out;
+    }
+
+    std::pair<iterator, iterator> equal_range(const value_type& value) const {
+        return { lower_bound(value), upper_bound(value) };
+    }
+
+private:
+    static node_t* child_at(node_t* node, size_type index) {
+        return static_cast<inner_t*>(node)->child[index];
+    }
+
+    static void set_child(node_t* node, size_type index, node_t* child) {
+        static_cast<inner_t*>(node)->child[index] = child;
+        child->par = node;
+        child->pos = static_cast<std::uint16_t>(index);
+    }
+
+
+    // first key not less than value; arithmetic keys are counted without branches
+    size_type lower_index(const node_t* node, const value_type& value) const {
+        const value_type* keys = node->keys();
+        if constexpr (std::is_arithmetic_v<value_type>) {
+            size_type index = 0;
+            for (size_type i = 0; i < node->count; ++i) {
+                index += comp_(keys[i], value);
+            }
+
+            return index;
+        }
+        else {
+            return std::lower_bound(keys, keys + node->count, value, comp_) - keys;
+        }
+    }
+
+    size_type upper_index(const node_t* node, const value_type& value) const {
+        const value_type* keys = node->keys();
+        if constexpr (std::is_arithmetic_v<value_type>) {
+            size_type index = 0;
+            for (size_type i = 0; i < node->count; ++i) {
+                index += !comp_(value, keys[i]);
+            }
+
+            return index;
+        }
+        else {
+            return std::upper_bound(keys, keys + node->count, value, comp_) - keys;
+        }
+    }
+
+
+    node_t* create_node(bool leaf) {
+        node_t* node;
+        if (leaf) {
+            node = leaf_traits_type::allocate(leaf_alloc_, 1);
+            std::construct_at(node);
+        }
+        else {
+            inner_t* inner = inner_traits_type::allocate(inner_alloc_, 1);
+            std::construct_at(inner);
+            node = inner;
+        }
+        node->leaf = leaf;
+
+        return node;
+    }
+
+    void destroy_node(node_t* node) {
+        std::destroy_n(node->keys(), node->count);
+        if (node->leaf) {
+            std::destroy_at(node);
+            leaf_traits_type::deallocate(leaf_alloc_, node, 1);
+        }
+        else {
+            inner_t* inner = static_cast<inner_t*>(node);
+            std::destroy_at(inner);
+            inner_traits_type::deallocate(inner_alloc_, inner, 1);
+        }
+    }
+
+    void delete_tree(node_t* node) {
+        if (!node) {
+            return;
+        }
+        if (!node->leaf) {
+            for (size_type i = 0; i <= node->count; ++i) {
+                delete_tree(child_at(node, i));
+            }
+        }
+        destroy_node(node);
+    }
+
+    node_t* copy(const node_t* in, node_t* par) {
+        if (!in) {
+            return nullptr;
+        }
+        node_t* out = create_node(in->leaf);
+        out->par = par;
+        out->pos = in->pos;
+        for (; out->count < in->count; ++out->count) {
+            std::construct_at(&out->key(out->count), in->key(out->count));
+        }
+        if (!in->leaf) {
+            for (size_type i = 0; i <= in->count; ++i) {
+                set_child(out, i, copy(child_at(const_cast<node_t*>(in), i), out));
+            }
+        }
+
+        return out;
+    }
+
+
+    template <typename value_t>
+    static void insert_key(node_t* node, size_type index, value_t&& value) {
+        value_type* keys = node->keys();
+        size_type count = node->count;
+        if (index == count) {
+            std::construct_at(keys + count, std::forward<value_t>(value));
+        }
+        else {
+            std::construct_at(keys + count, std::move(keys[count - 1]));
+            std::move_backward(keys + index, keys + count - 1, keys + count);
+            keys[index] = std::forward<value_t>(value);
+        }
+        ++node->count;
+    }
+
+    static void erase_key_at(node_t* node, size_type index) {
+        value_type* keys = node->keys();
+        std::move(keys + index + 1, keys + node->count, keys + index);
+        std::destroy_at(keys + node->count - 1);
+        --node->count;
+    }
+
+
+    template <typename value_t>
+    std::pair<iterator, bool> insert_unique(value_t&& value) {
+        iterator found = find(value);
+        if (found.node_) {
+            return { found, false };
+        }
+        if (!root_) {
+            root_ = create_node(true);
+        }
+        else if (root_->count == max_keys) {
+            node_t* top = create_node(false);
+            set_child(top, 0, root_);
+            root_ = top;
+            split_child(top, 0);
+        }
+
+        node_t* node = root_;
+        while (!node->leaf) {
+            size_type index = lower_index(node, value);
+            if (child_at(node, index)->count == max_keys) {
+                split_child(node, index);
+                if (comp_(node->key(index), value)) {
+                    ++index;
+                }
+            }
+            node = child_at(node, index);
+        }
+        size_type index = lower_index(node, value);
+        insert_key(node, index, std::forward<value_t>(value));
+        ++size_;
+
+        return { iterator(node, index, &root_), true };
+    }
+
+    // moves the upper half of the full child at index into a new right sibling, the median goes up
+    void split_child(node_t* par, size_type index) {
+        node_t* full = child_at(par, index);
+        node_t* right = create_node(full->leaf);
+        size_type mid = max_keys / 2;
+
+        for (size_type i = mid + 1; i < max_keys; ++i) {
+            std::construct_at(&right->key(right->count++), std::move(full->key(i)));
+            std::destroy_at(&full->key(i));
+        }
+        if (!full->leaf) {
+            for (size_type i = mid + 1; i <= max_keys; ++i) {
+                set_child(right, i - mid - 1, child_at(full, i));
+            }
+        }
+
+        insert_key(par, index, std::move(full->key(mid)));
+        std::destroy_at(&full->key(mid));
+        full->count = static_cast<std::uint16_t>(mid);
+
+        for (size_type i = par->count; i > index + 1; --i) {
+            set_child(par, i, child_at(par, i - 1));
+        }
+        set_child(par, index + 1, right);
+    }
+
+
+    // single top-down pass: every child is topped up above min_keys before the descent enters it
+    void erase_key(const value_type& value) {
+        node_t* node = root_;
+        erase_mode mode = erase_mode::by_key;
+
+        while (true) {
+            size_type index = 0;
+            bool here = false;
+            if (mode == erase_mode::by_key) {
+                index = lower_index(node, value);
+                here = index < node->count && !comp_(value, node->key(index));
+            }
+            else if (mode == erase_mode::max) {
+                index = node->count;
+            }
+
+            if (node->leaf) {
+                if (mode == erase_mode::max) {
+                    index = node->count - 1;
+                }
+                erase_key_at(node, index);
+                break;
+            }
+
+            if (here) {
+                node_t* left = child_at(node, index);
+                node_t* right = child_at(node, index + 1);
+                if (left->count > min_keys) {
+                    node->key(index) = std::move(*max_key(left));
+                    node = left;
+                    mode = erase_mode::max;
+                }
+                else if (right->count > min_keys) {
+                    node->key(index) = std::move(*min_key(right));
+                    node = right;
+                    mode = erase_mode::min;
+                }
+                else {
+                    node = merge_children(node, index);
+                }
+            }
+            else {
+                node = fill_child(node, index);
+            }
+        }
+        --size_;
+
+        if (root_->count == 0) {
+            node_t* old = root_;
+            root_ = root_->leaf ? nullptr : child_at(root_, 0);
+            if (root_) {
+                root_->par = nullptr;
+                root_->pos = 0;
+            }
+            destroy_node(old);
+        }
+    }
+
+    static value_type* max_key(node_t* node) {
+        while (!node->leaf) {
+            node = child_at(node, node->count);
+        }
+
+        return &node->key(node->count - 1);
+    }
+
+    static value_type* min_key(node_t* node) {
+        while (!node->leaf) {
+            node = child_at(node, 0);
+        }
+
+        return &node->key(0);
+    }
+
+    // returns the child to descend into after making sure it can lose a key
+    node_t* fill_child(node_t* par, size_type index) {
+        node_t* child = child_at(par, index);
+        if (child->count > min_keys) {
+            return child;
+        }
+
+        if (index > 0 && child_at(par, index - 1)->count > min_keys) {
+            node_t* left = child_at(par, index - 1);
+            insert_key(child, 0, std::move(par->key(index - 1)));
+            par->key(index - 1) = std::move(left->key(left->count - 1));
+            if (!child->leaf) {
+                for (size_type i = child->count; i > 0; --i) {
+                    set_child(child, i, child_at(child, i - 1));
+                }
+                set_child(child, 0, child_at(left, left->count));
+            }
+            erase_key_at(left, left->count - 1);
+
+            return child;
+        }
+        if (index < par->count && child_at(par, index + 1)->count > min_keys) {
+            node_t* right = child_at(par, index + 1);
+            insert_key(child, child->count, std::move(par->key(index)));
+            par->key(index) = std::move(right->key(0));
+            if (!child->leaf) {
+                set_child(child, child->count, child_at(right, 0));
+                for (size_type i = 0; i < right->count; ++i) {
+                    set_child(right, i, child_at(right, i + 1));
+                }
+            }
+            erase_key_at(right, 0);
+
+            return child;
+        }
+
+        return index < par->count ? merge_children(par, index) : merge_children(par, index - 1);
+    }
+
+    // pulls the separator at index down and appends the right sibling to the left one
+    node_t* merge_children(node_t* par, size_type index) {
+        node_t* left = child_at(par, index);
+        node_t* right = child_at(par, index + 1);
+
+        insert_key(left, left->count, std::move(par->key(index)));
+        size_type base = left->count;
+        for (size_type i = 0; i < right->count; ++i) {
+            std::construct_at(&left->key(base + i), std::move(right->key(i)));
+        }
+        if (!left->leaf) {
+            for (size_type i = 0; i <= right->count; ++i) {
+                set_child(left, base + i, child_at(right, i));
+            }
+        }
+        left->count = static_cast<std::uint16_t>(base + right->count);
+
+        erase_key_at(par, index);
+        for (size_type i = index + 1; i <= par->count; ++i) {
+            set_child(par, i, child_at(par, i + 1));
+        }
+        destroy_node(right);
+
+        return left;
+    }
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include "epoch.h"
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Node of a leaf-oriented tree: leaves hold the values, inner nodes only route, keys below an
+// inner node's value go left and the others right.
+template <typename T>
+struct ConcurrentNode {
+    // left unconstructed in the head node
+    union {
+        T value;
+    };
+    bool leaf;
+    bool head;
+    // set once the node is unlinked, only accessed under the node's lock
+    bool removed;
+    std::atomic_flag locked;
+    std::atomic<ConcurrentNode*> lhs;
+    std::atomic<ConcurrentNode*> rhs;
+
+    // head of a tree, routes everything to lhs
+    ConcurrentNode()
+        : leaf(false), head(true), removed(false), lhs(nullptr), rhs(nullptr) {
+    }
+
+    template <typename... Args>
+    ConcurrentNode(bool leaf, ConcurrentNode* lhs, ConcurrentNode* rhs, Args&&... args)
+        : value(std::forward<Args>(args)...), leaf(leaf), head(false), removed(false), lhs(lhs), rhs(rhs) {
+    }
+
+    // writers hold a node only for a handful of stores, so spinning beats parking
+    void lock() {
+        while (locked.test_and_set(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    void unlock() {
+        locked.clear(std::memory_order_release);
+    }
+
+    ~ConcurrentNode() requires std::is_trivially_destructible_v<T> = default;
+
+    ~ConcurrentNode() {
+        if (!head) {
+            value.~T();
+        }
+    }
+};
+
+
+// Ordered set for many reader and writer threads. Readers never lock or wait: they pin an epoch
+// and walk child links published with release stores. Writers only ever swing one link per
+// operation (a leaf becomes a small subtree, or a leaf and its parent are cut out), so a reader
+// sees either the old or the new shape, and unlinked nodes are reclaimed once no pinned reader
+// can hold them. A writer locks just the parent (insert) or grandparent and parent (erase) of its
+// leaf, top-down, then checks that the locked nodes are still linked as its search found them
+// and retries otherwise, so writes to different parts of the tree run in parallel. The tree is
+// not rebalanced: depth follows the insertion order of the keys.
+template <
+    typename T,
+    typename Comp = std::less<T>
+>
+class ConcurrentSearchTree {
+private:
+    using node_t = ConcurrentNode<T>;
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using key_type = T;
+    using key_compare = Comp;
+    using value_compare = Comp;
+
+public:
+    ConcurrentSearchTree()
+        : comp_(Comp()), size_(0) {}
+
+    explicit ConcurrentSearchTree(const Comp& comp)
+        : comp_(comp), size_(0) {}
+
+    ConcurrentSearchTree(const ConcurrentSearchTree&) = delete;
+    ConcurrentSearchTree& operator =(const ConcurrentSearchTree&) = delete;
+
+    // no other thread may use the tree any more
+    ~ConcurrentSearchTree() {
+        std::vector<node_t*> stack;
+        if (node_t* root = head_.lhs.load(std::memory_order_relaxed)) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            node_t* node = stack.back();
+            stack.pop_back();
+            if (!node->leaf) {
+                stack.push_back(node->lhs.load(std::memory_order_relaxed));
+                stack.push_back(node->rhs.load(std::memory_order_relaxed));
+            }
+            delete node;
+        }
+    }
+
+
+    size_type size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    key_compare key_comp() const {
+        return comp_;
+    }
+
+
+    bool contains(const value_type& value) const {
+        auto guard = domain_.pin();
+
+        return find_leaf(value) != nullptr;
+    }
+
+    // copies are returned because nodes may be reclaimed as soon as the call returns
+    std::optional<value_type> find(const value_type& value) const {
+        auto guard = domain_.pin();
+        if (node_t* leaf = find_leaf(value)) {
+            return leaf->value;
+        }
+
+        return std::nullopt;
+    }
+
+    std::optional<value_type> lower_bound(const value_type& value) const {
+        auto guard = domain_.pin();
+        if (node_t* leaf = lower_bound_leaf(value)) {
+            return leaf->value;
+        }
+
+        return std::nullopt;
+    }
+
+    // visits the values in increasing order; writes that race with the walk may or may not be seen
+    template <typename Func>
+    void for_each(Func func) const {
+        auto guard = domain_.pin();
+        std::vector<node_t*> stack;
+        if (node_t* root = head_.lhs.load(std::memory_order_acquire)) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            node_t* node = stack.back();
+            stack.pop_back();
+            if (node->leaf) {
+                func(std::as_const(node->value));
+            }
+            else {
+                stack.push_back(node->rhs.load(std::memory_order_acquire));
+                stack.push_back(node->lhs.load(std::memory_order_acquire));
+            }
+        }
+    }
+
+
+    bool insert(const value_type& value) {
+        return insert_unique(value);
+    }
+
+    bool insert(value_type&& value) {
+        return insert_unique(std::move(value));
+    }
+
+    size_type erase(const value_type& value) {
+        auto guard = domain_.pin();
+        while (true) {
+            auto [grand, par, leaf] = search(value);
+            if (!leaf || !equal(leaf->value, value)) {
+                return 0;
+            }
+
+            if (par == &head_) {
+                std::lock_guard<node_t> par_lock(*par);
+                if (!linked(par, value, leaf)) {
+                    continue;
+                }
+                head_.lhs.store(nullptr, std::memory_order_release);
+            }
+            else {
+                std::lock_guard<node_t> grand_lock(*grand);
+                std::lock_guard<node_t> par_lock(*par);
+                if (grand->removed || par->removed || !linked(grand, value, par) || !linked(par, value, leaf)) {
+                    continue;
+                }
+                node_t* sibling = par->lhs.load(std::memory_order_relaxed) == leaf
+                    ? par->rhs.load(std::memory_order_relaxed)
+                    : par->lhs.load(std::memory_order_relaxed);
+                child_link(grand, par).store(sibling, std::memory_order_release);
+                par->removed = true;
+                retire(guard, par);
+            }
+            retire(guard, leaf);
+            size_.fetch_sub(1, std::memory_order_relaxed);
+
+            return 1;
+        }
+    }
+
+private:
+    struct search_result {
+        node_t* grand;
+        node_t* par;
+        node_t* leaf;
+    };
+
+
+    bool equal(const value_type& lhs, const value_type& rhs) const {
+        return !comp_(lhs, rhs) && !comp_(rhs, lhs);
+    }
+
+
+    node_t* child(const node_t* node, const value_type& value) const {
+        if (node->head || comp_(value, node->value)) {
+            return node->lhs.load(std::memory_order_acquire);
+        }
+
+        return node->rhs.load(std::memory_order_acquire);
+    }
+
+
+    // whether the search for value still leads from par straight to node
+    bool linked(const node_t* par, const value_type& value, const node_t* node) const {
+        return child(par, value) == node;
+    }
+
+
+    static std::atomic<node_t*>& child_link(node_t* par, const node_t* node) {
+        return par->lhs.load(std::memory_order_relaxed) == node ? par->lhs : par->rhs;
+    }
+
+
+    // leaf where value is or would be linked, with its parent and grandparent
+    search_result search(const value_type& value) const {
+        node_t* grand = nullptr;
+        node_t* par = const_cast<node_t*>(&head_);
+        node_t* node = child(par, value);
+        while (node && !node->leaf) {
+            grand = par;
+            par = node;
+            node = child(node, value);
+        }
+
+        return { grand, par, node };
+    }
+
+
+    node_t* find_leaf(const value_type& value) const {
+        node_t* leaf = search(value).leaf;
+
+        return leaf && equal(leaf->value, value) ? leaf : nullptr;
+    }
+
+
+    // the subtree right of the last left turn holds the next larger values
+    node_t* lower_bound_leaf(const value_type& value) const {
+        node_t* after = nullptr;
+        node_t* node = head_.lhs.load(std::memory_order_acquire);
+        while (node && !node->leaf) {
+            if (comp_(value, node->value)) {
+                after = node->rhs.load(std::memory_order_acquire);
+                node = node->lhs.load(std::memory_order_acquire);
+            }
+            else {
+                node = node->rhs.load(std::memory_order_acquire);
+            }
+        }
+        if (node && !comp_(node->value, value)) {
+            return node;
+        }
+
+        node = after;
+        while (node && !node->leaf) {
+            node = node->lhs.load(std::memory_order_acquire);
+        }
+
+        return node;
+    }
+
+
+    // the leaf found is replaced by an inner node over it and the new leaf, one published store
+    template <typename value_t>
+    bool insert_unique(value_t&& value) {
+        auto guard = domain_.pin();
+        std::unique_ptr<node_t> fresh;
+        while (true) {
+            // value is moved into fresh on the first pass
+            const value_type& key = fresh ? fresh->value : value;
+            auto [grand, par, leaf] = search(key);
+            if (leaf && equal(leaf->value, key)) {
+                return false;
+            }
+            if (!fresh) {
+                fresh = std::make_unique<node_t>(true, nullptr, nullptr, std::forward<value_t>(value));
+            }
+
+            // the inner node is built before locking, so the lock covers a single store
+            std::unique_ptr<node_t> inner;
+            if (leaf && comp_(fresh->value, leaf->value)) {
+                inner = std::make_unique<node_t>(false, fresh.get(), leaf, leaf->value);
+            }
+            else if (leaf) {
+                inner = std::make_unique<node_t>(false, leaf, fresh.get(), fresh->value);
+            }
+
+            std::lock_guard<node_t> par_lock(*par);
+            if (par->removed || !linked(par, fresh->value, leaf)) {
+                continue;
+            }
+            if (!leaf) {
+                head_.lhs.store(fresh.release(), std::memory_order_release);
+            }
+            else {
+                fresh.release();
+                child_link(par, leaf).store(inner.release(), std::memory_order_release);
+            }
+            size_.fetch_add(1, std::memory_order_relaxed);
+
+            return true;
+        }
+    }
+
+
+    void retire(EpochDomain::Guard& guard, node_t* node) {
+        domain_.retire(guard, node, [](void* object) {
+            delete static_cast<node_t*>(object);
+        });
+    }
+
+private:
+    mutable EpochDomain domain_;
+    node_t head_;
+    key_compare comp_;
+    std::atomic<size_type> size_;
+};
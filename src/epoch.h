@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+// Epoch-based reclamation. Readers pin the current epoch for as long as they hold pointers
+// into a shared structure; writers retire objects after unlinking them, and an object retired
+// in epoch e is reclaimed once the global epoch reaches e + 2, when no pinned reader can
+// still reach it. Writers retire through their own guard into a list kept with its slot, so
+// they never contend with each other; each list is collected by whoever holds the slot, and
+// what a released slot still holds waits for its next taker. Pinning never waits: when every
+// slot is taken, another block of slots is linked in, and blocks stay until the domain goes away.
+class EpochDomain {
+public:
+    static constexpr std::size_t slots_per_block = 128;
+
+private:
+    struct Retired {
+        void* object;
+        void (*reclaim)(void*);
+        std::uint64_t epoch;
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<bool> taken{false};
+        // 0 while the slot is not pinned
+        std::atomic<std::uint64_t> epoch{0};
+        // only touched by the thread holding the slot, taking it orders it after the last holder
+        std::vector<Retired> retired;
+    };
+
+    struct Block {
+        std::array<Slot, slots_per_block> slots;
+        std::atomic<Block*> next{nullptr};
+    };
+
+    static constexpr std::size_t collect_threshold = 64;
+
+public:
+    // keeps everything retired from now on alive until it is destroyed
+    class Guard {
+        friend class EpochDomain;
+    public:
+        Guard(const Guard&) = delete;
+        Guard& operator =(const Guard&) = delete;
+
+        Guard(Guard&& other) noexcept
+            : slot_(other.slot_) {
+            other.slot_ = nullptr;
+        }
+
+        ~Guard() {
+            if (slot_) {
+                slot_->epoch.store(0, std::memory_order_release);
+                slot_->taken.store(false, std::memory_order_release);
+            }
+        }
+
+    private:
+        explicit Guard(Slot* slot)
+            : slot_(slot) {
+        }
+
+    private:
+        Slot* slot_;
+    };
+
+public:
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator =(const EpochDomain&) = delete;
+
+    // nothing may be pinned any more
+    ~EpochDomain() {
+        for (Block* block = &first_block_; block; block = block->next.load(std::memory_order_relaxed)) {
+            for (Slot& slot : block->slots) {
+                for (const Retired& retired : slot.retired) {
+                    retired.reclaim(retired.object);
+                }
+            }
+        }
+        Block* block = first_block_.next.load(std::memory_order_relaxed);
+        while (block) {
+            Block* next = block->next.load(std::memory_order_relaxed);
+            delete block;
+            block = next;
+        }
+    }
+
+
+    Guard pin() {
+        Slot* slot = acquire_slot();
+        std::uint64_t epoch;
+        do {
+            epoch = global_.load();
+            slot->epoch.store(epoch);
+            // the slot is visible before any link the reader goes on to load, see retire()
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        } while (global_.load() != epoch);
+
+        return Guard(slot);
+    }
+
+    // object must already be unreachable for readers that pin after this call; guard is the
+    // caller's own
+    void retire(Guard& guard, void* object, void (*reclaim)(void*)) {
+        // pairs with the fence in pin(): a reader that could still load the old link has its
+        // slot seen by collect(), so the grace period cannot end under it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::vector<Retired>& retired = guard.slot_->retired;
+        retired.push_back({ object, reclaim, global_.load() });
+        if (retired.size() >= collect_threshold) {
+            collect(retired);
+        }
+    }
+
+private:
+    // readers start probing at a per-thread slot so they rarely share a cache line
+    Slot* acquire_slot() {
+        static thread_local std::size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+        Block* last = &first_block_;
+        for (Block* block = last; block; block = block->next.load(std::memory_order_acquire)) {
+            for (std::size_t i = 0; i < slots_per_block; ++i) {
+                Slot& slot = block->slots[(hint + i) % slots_per_block];
+                bool expected = false;
+                if (!slot.taken.load(std::memory_order_relaxed) && slot.taken.compare_exchange_strong(expected, true)) {
+                    return &slot;
+                }
+            }
+            last = block;
+        }
+
+        // all taken: a new block is appended with its first slot already ours
+        Block* fresh = new Block;
+        fresh->slots[0].taken.store(true, std::memory_order_relaxed);
+        Block* expected = nullptr;
+        while (!last->next.compare_exchange_weak(expected, fresh, std::memory_order_release, std::memory_order_acquire)) {
+            if (expected) {
+                last = expected;
+                expected = nullptr;
+            }
+        }
+
+        return &fresh->slots[0];
+    }
+
+    template <typename Func>
+    bool all_slots(Func func) const {
+        for (const Block* block = &first_block_; block; block = block->next.load(std::memory_order_acquire)) {
+            if (!std::all_of(block->slots.begin(), block->slots.end(), func)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // advances the epoch if every pinned reader has seen the current one, then frees what has aged
+    // in one slot's list
+    void collect(std::vector<Retired>& retired) {
+        std::uint64_t epoch = global_.load();
+        bool quiescent = all_slots([epoch](const Slot& slot) {
+            std::uint64_t pinned = slot.epoch.load();
+            return pinned == 0 || pinned == epoch;
+        });
+        if (quiescent) {
+            global_.compare_exchange_strong(epoch, epoch + 1);
+        }
+
+        std::uint64_t now = global_.load();
+        auto aged = std::partition(retired.begin(), retired.end(), [now](const Retired& entry) {
+            return entry.epoch + 2 > now;
+        });
+        for (auto it = aged; it != retired.end(); ++it) {
+            it->reclaim(it->object);
+        }
+        retired.erase(aged, retired.end());
+    }
+
+private:
+    std::atomic<std::uint64_t> global_{1};
+    Block first_block_;
+};
@@ -0,0 +1,470 @@
+#pragma once
+
+#include "iterator.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// in-order walk over an Eytzinger array: slot k has children 2k and 2k + 1, slot 0 is end()
+template <typename T>
+class FrozenIterator {
+    template <typename, typename>
+    friend class FrozenView;
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+public:
+    FrozenIterator() : data_(nullptr), size_(0), index_(0) {}
+
+    reference operator *() const {
+        return data_[index_];
+    }
+    pointer operator ->() const {
+        return data_ + index_;
+    }
+
+    bool operator ==(const FrozenIterator& arg) const {
+        return index_ == arg.index_;
+    }
+    bool operator !=(const FrozenIterator& arg) const {
+        return index_ != arg.index_;
+    }
+
+    FrozenIterator& operator ++() {
+        if (index_ == 0) {
+            index_ = descend(1, 0);
+        }
+        else if (2 * index_ + 1 <= size_) {
+            index_ = descend(2 * index_ + 1, 0);
+        }
+        else {
+            index_ >>= std::countr_one(index_) + 1;
+        }
+
+        return *this;
+    }
+    FrozenIterator operator ++(int) {
+        FrozenIterator temp = *this;
+        ++*this;
+
+        return temp;
+    }
+
+    FrozenIterator& operator --() {
+        if (index_ == 0) {
+            index_ = descend(1, 1);
+        }
+        else if (2 * index_ <= size_) {
+            index_ = descend(2 * index_, 1);
+        }
+        else {
+            index_ >>= std::countr_zero(index_) + 1;
+        }
+
+        return *this;
+    }
+    FrozenIterator operator --(int) {
+        FrozenIterator temp = *this;
+        --*this;
+
+        return temp;
+    }
+
+private:
+    FrozenIterator(const T* data, std::size_t size, std::size_t index)
+        : data_(data), size_(size), index_(index) {
+    }
+
+    // follows left (side 0) or right (side 1) children as far as they exist
+    std::size_t descend(std::size_t index, std::size_t side) const {
+        if (index > size_) {
+            return 0;
+        }
+        while (2 * index + side <= size_) {
+            index = 2 * index + side;
+        }
+
+        return index;
+    }
+
+private:
+    const T* data_;
+    std::size_t size_;
+    std::size_t index_;
+};
+
+
+// First bytes of a saved frozen tree. The header is padded to a cache line and followed by the
+// Eytzinger array exactly as it sits in memory, slot 0 included, so a mapped file can be searched
+// in place: children are found by index, there are no pointers to translate.
+struct FrozenFileHeader {
+    static constexpr std::size_t size = 64;
+    static constexpr char signature[8] = { 'F', 'R', 'O', 'Z', 'E', 'N', '\0', '\1' };
+    // written as the writer's byte order sees it
+    static constexpr std::uint32_t byte_order = 0x01020304;
+
+    char magic[8];
+    std::uint32_t order;
+    std::uint32_t value_size;
+    std::uint64_t count;
+
+    template <typename T>
+    static FrozenFileHeader describe(std::uint64_t count) {
+        FrozenFileHeader header;
+        std::memcpy(header.magic, signature, sizeof(signature));
+        header.order = byte_order;
+        header.value_size = sizeof(T);
+        header.count = count;
+
+        return header;
+    }
+
+    // throws unless the file was written for T on a machine with the same byte order
+    template <typename T>
+    void check() const {
+        if (std::memcmp(magic, signature, sizeof(signature)) != 0) {
+            throw std::runtime_error("not a frozen tree file");
+        }
+        if (order != byte_order || value_size != sizeof(T)) {
+            throw std::runtime_error("frozen tree file was written for another value type or byte order");
+        }
+        // count + 1 slots, slot 0 included, must be addressable and readable in one go
+        if (count >= std::uint64_t(std::numeric_limits<std::streamsize>::max()) / sizeof(T)) {
+            throw std::runtime_error("frozen tree file claims more values than fit in memory");
+        }
+    }
+};
+
+static_assert(sizeof(FrozenFileHeader) <= FrozenFileHeader::size);
+
+
+// Read-only Eytzinger (BFS) array of a sorted set, the storage belongs to a derived class: lookups
+// are a branch-free walk over the array that prefetches the cache line holding the node's
+// descendants a few levels down
+template <
+    typename T,
+    typename Comp = std::less<T>
+>
+class FrozenView {
+public:
+    using value_type = T;
+    using reference = const value_type&;
+    using const_reference = const value_type&;
+    using iterator = FrozenIterator<T>;
+    using const_iterator = FrozenIterator<T>;
+    using difference_type = std::ptrdiff_t;
+    using size_type = std::size_t;
+
+    using key_type = T;
+    using key_compare = Comp;
+    using value_compare = Comp;
+
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+protected:
+    static constexpr std::size_t cache_line = 64;
+    static constexpr size_type prefetch_stride = std::max<size_type>(1, cache_line / sizeof(T));
+
+public:
+    iterator begin() const {
+        return ++end();
+    }
+
+    iterator end() const {
+        return iterator(data_, size_, 0);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    reverse_iterator rbegin() const {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const {
+        return reverse_iterator(begin());
+    }
+
+
+    size_type size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    key_compare key_comp() const {
+        return comp_;
+    }
+
+
+    iterator find(const value_type& value) const {
+        size_type index = lower_index(value);
+        if (index && comp_(value, data_[index])) {
+            index = 0;
+        }
+
+        return iterator(data_, size_, index);
+    }
+
+    iterator lower_bound(const value_type& value) const {
+        return iterator(data_, size_, lower_index(value));
+    }
+
+    iterator upper_bound(const value_type& value) const {
+        return iterator(data_, size_, upper_index(value));
+    }
+
+    std::pair<iterator, iterator> equal_range(const value_type& value) const {
+        return { lower_bound(value), upper_bound(value) };
+    }
+
+
+    // the array is written as is, a FrozenFileHeader ahead of it; load with FrozenTree::load or
+    // map with MappedTree. Errors are reported through the stream state
+    void save(std::ostream& out) const
+        requires std::is_trivially_copyable_v<T> {
+        char header[FrozenFileHeader::size] = {};
+        FrozenFileHeader description = FrozenFileHeader::describe<T>(size_);
+        std::memcpy(header, &description, sizeof(description));
+        out.write(header, sizeof(header));
+
+        // slot 0 is never read, zeros keep the file deterministic
+        char unused[sizeof(T)] = {};
+        out.write(unused, sizeof(unused));
+        if (size_) {
+            out.write(reinterpret_cast<const char*>(data_ + 1), std::streamsize(size_ * sizeof(T)));
+        }
+    }
+
+protected:
+    FrozenView(const T* data, size_type size, const Comp& comp)
+        : data_(data), size_(size), comp_(comp) {}
+
+    void swap(FrozenView& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(comp_, other.comp_);
+    }
+
+private:
+    void prefetch(size_type index) const {
+#if defined(__GNUC__) || defined(__clang__)
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(data_) + index * prefetch_stride * sizeof(T);
+        __builtin_prefetch(reinterpret_cast<const void*>(address));
+#endif
+    }
+
+    // every comparison only picks the next slot, the answer is the last left turn
+    size_type lower_index(const value_type& value) const {
+        size_type index = 1;
+        while (index <= size_) {
+            prefetch(index);
+            index = 2 * index + comp_(data_[index], value);
+        }
+
+        return index >> (std::countr_one(index) + 1);
+    }
+
+    size_type upper_index(const value_type& value) const {
+        size_type index = 1;
+        while (index <= size_) {
+            prefetch(index);
+            index = 2 * index + !comp_(value, data_[index]);
+        }
+
+        return index >> (std::countr_one(index) + 1);
+    }
+
+protected:
+    // slot 0 is unused, the root is slot 1
+    const T* data_;
+    size_type size_;
+    key_compare comp_;
+};
+
+
+// immutable snapshot of a sorted set that owns its Eytzinger array
+template <
+    typename T,
+    typename Comp = std::less<T>
+>
+class FrozenTree : public FrozenView<T, Comp> {
+private:
+    using view_type = FrozenView<T, Comp>;
+    using view_type::cache_line;
+
+public:
+    using typename view_type::size_type;
+
+public:
+    FrozenTree()
+        : view_type(nullptr, 0, Comp()) {}
+
+    template <
+        std::input_iterator input_iter_t
+    >
+    FrozenTree(sorted_unique_t, input_iter_t lhs, input_iter_t rhs, const Comp& comp = Comp())
+        : view_type(nullptr, 0, comp) {
+        if constexpr (std::forward_iterator<input_iter_t>) {
+            build(lhs, std::distance(lhs, rhs));
+        }
+        else {
+            std::vector<T> values(lhs, rhs);
+            build(values.begin(), values.size());
+        }
+    }
+
+    FrozenTree(const FrozenTree& other)
+        : view_type(nullptr, 0, other.comp_) {
+        T* data = allocate(other.size_);
+        size_type built = 0;
+        try {
+            for (; built < other.size_; ++built) {
+                std::construct_at(data + built + 1, other.data_[built + 1]);
+            }
+        }
+        catch (...) {
+            // the destructor does not run for a constructor that throws
+            std::destroy(data + 1, data + built + 1);
+            ::operator delete(data, std::align_val_t(cache_line));
+            throw;
+        }
+        this->data_ = data;
+        this->size_ = other.size_;
+    }
+
+    FrozenTree(FrozenTree&& other) noexcept
+        : view_type(other.data_, other.size_, other.comp_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    FrozenTree& operator =(FrozenTree other) {
+        swap(other);
+
+        return *this;
+    }
+
+    ~FrozenTree() {
+        if (this->data_) {
+            T* data = const_cast<T*>(this->data_);
+            std::destroy(data + 1, data + this->size_ + 1);
+            ::operator delete(data, std::align_val_t(cache_line));
+        }
+    }
+
+
+    void swap(FrozenTree& other) noexcept {
+        view_type::swap(other);
+    }
+
+
+    // reads what save() wrote, throws std::runtime_error on a malformed, unsorted or truncated
+    // stream
+    static FrozenTree load(std::istream& in, const Comp& comp = Comp())
+        requires std::is_trivially_copyable_v<T> {
+        char header[FrozenFileHeader::size];
+        FrozenFileHeader description;
+        if (!in.read(header, sizeof(header))) {
+            throw std::runtime_error("truncated frozen tree file");
+        }
+        std::memcpy(&description, header, sizeof(description));
+        description.check<T>();
+
+        FrozenTree res(comp);
+        T* data = allocate(description.count);
+        res.data_ = data;
+        if (!in.read(reinterpret_cast<char*>(data), std::streamsize((description.count + 1) * sizeof(T)))) {
+            throw std::runtime_error("truncated frozen tree file");
+        }
+        res.size_ = description.count;
+        // lookups rely on the order, so values that are not strictly increasing are rejected
+        auto unordered = std::adjacent_find(res.begin(), res.end(), [&res](const T& lhs, const T& rhs) {
+            return !res.comp_(lhs, rhs);
+        });
+        if (unordered != res.end()) {
+            throw std::runtime_error("frozen tree file is not sorted");
+        }
+
+        return res;
+    }
+
+private:
+    explicit FrozenTree(const Comp& comp)
+        : view_type(nullptr, 0, comp) {}
+
+    // the root sits at index 1, so with a line-aligned array every group of
+    // prefetch_stride descendants of a node starts on its own cache line
+    static T* allocate(size_type count) {
+        return static_cast<T*>(::operator new((count + 1) * sizeof(T), std::align_val_t(cache_line)));
+    }
+
+    template <typename iter_t>
+    void build(iter_t lhs, size_type count) {
+        T* data = allocate(count);
+        size_type built = 0;
+        try {
+            fill(data, lhs, 1, count, built);
+        }
+        catch (...) {
+            unfill(data, 1, count, built);
+            ::operator delete(data, std::align_val_t(cache_line));
+            throw;
+        }
+        this->data_ = data;
+        this->size_ = count;
+    }
+
+    // in-order fill of the implicit tree; only the depth, log2(count), is recursed
+    template <typename iter_t>
+    static void fill(T* data, iter_t& lhs, size_type index, size_type count, size_type& built) {
+        if (index > count) {
+            return;
+        }
+        fill(data, lhs, 2 * index, count, built);
+        std::construct_at(data + index, *lhs);
+        ++built;
+        ++lhs;
+        fill(data, lhs, 2 * index + 1, count, built);
+    }
+
+    // destroys what an interrupted fill constructed: the first built values in the same order
+    static void unfill(T* data, size_type index, size_type count, size_type& built) {
+        if (index > count || built == 0) {
+            return;
+        }
+        unfill(data, 2 * index, count, built);
+        if (built == 0) {
+            return;
+        }
+        std::destroy_at(data + index);
+        --built;
+        unfill(data, 2 * index + 1, count, built);
+    }
+};
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <iostream>
+#include <atomic>
+#include <concepts>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <type_traits>
+#include <utility>
 
 
 struct in_order_tag {};
@@ -11,15 +15,193 @@ struct pre_order_tag {};
 struct post_order_tag {};
 
 
-template <typename T>
-struct Node {
-    T value;
+struct no_augment_tag {};
+struct order_statistics_tag {};
+struct threaded_tag {};
+// counts comparisons, visited nodes, allocations and iterator steps, see SearchTree::stats()
+struct instrumented_tag {};
+
+// Keeps Monoid::combine over the values of every subtree, so SearchTree::aggregate answers for
+// a key range in O(log n). Monoid provides value_type, static identity(), static lift(value) and
+// an associative static combine(lhs, rhs); values are combined in key order
+template <typename Monoid>
+struct range_aggregate {};
+
+// several augmentations on one tree, e.g. augments<order_statistics_tag, threaded_tag>
+template <typename... Tags>
+struct augments {};
+
+
+template <typename Augment>
+inline constexpr bool is_augment_v = std::is_same_v<Augment, no_augment_tag> ||
+    std::is_same_v<Augment, order_statistics_tag> || std::is_same_v<Augment, threaded_tag> ||
+    std::is_same_v<Augment, instrumented_tag>;
+
+template <typename Monoid>
+inline constexpr bool is_augment_v<range_aggregate<Monoid>> = true;
+
+template <typename... Tags>
+inline constexpr bool is_augment_v<augments<Tags...>> = (is_augment_v<Tags> && ...);
+
+template <typename Augment>
+concept augmentTag = is_augment_v<Augment>;
+
+
+template <typename Augment, typename Tag>
+inline constexpr bool has_augment_v = std::is_same_v<Augment, Tag>;
+
+template <typename... Tags, typename Tag>
+inline constexpr bool has_augment_v<augments<Tags...>, Tag> = (std::is_same_v<Tags, Tag> || ...);
+
+
+// the Monoid of a range_aggregate among Augment, void if there is none
+template <typename Augment>
+struct aggregate_monoid {
+    using type = void;
+};
+
+template <typename Monoid>
+struct aggregate_monoid<range_aggregate<Monoid>> {
+    using type = Monoid;
+};
+
+template <typename Tag, typename... Tags>
+struct aggregate_monoid<augments<Tag, Tags...>> {
+    using type = std::conditional_t<std::is_void_v<typename aggregate_monoid<Tag>::type>,
+        typename aggregate_monoid<augments<Tags...>>::type, typename aggregate_monoid<Tag>::type>;
+};
+
+template <typename Augment>
+using aggregate_monoid_t = typename aggregate_monoid<Augment>::type;
+
+
+template <
+    typename Monoid,
+    typename T
+>
+concept aggregateMonoid = requires(const T& value, const typename Monoid::value_type& aggregate) {
+    { Monoid::identity() } -> std::convertible_to<typename Monoid::value_type>;
+    { Monoid::lift(value) } -> std::convertible_to<typename Monoid::value_type>;
+    { Monoid::combine(aggregate, aggregate) } -> std::convertible_to<typename Monoid::value_type>;
+};
+
+
+// per-node fields an augmentation keeps up to date on every structural change
+template <typename Augment, typename node_t>
+struct NodeAugment {};
+
+template <typename node_t>
+struct NodeAugment<order_statistics_tag, node_t> {
+    // nodes in the subtree rooted here, this one included
+    std::size_t count = 1;
+};
+
+template <typename node_t>
+struct NodeAugment<threaded_tag, node_t> {
+    // neighbours in the tree's traversal order, a ring closed by the header
+    node_t* next = nullptr;
+    node_t* prev = nullptr;
+};
+
+template <
+    typename Monoid,
+    typename node_t
+>
+struct NodeAugment<range_aggregate<Monoid>, node_t> {
+    // Monoid::combine over the subtree rooted here, in key order
+    typename Monoid::value_type aggregate = Monoid::identity();
+};
+
+template <typename... Tags, typename node_t>
+struct NodeAugment<augments<Tags...>, node_t> : NodeAugment<Tags, node_t>... {};
+
+
+// what an instrumented tree has counted so far
+struct TreeStats {
+    std::uint64_t comparisons = 0;
+    std::uint64_t nodes_visited = 0;
+    std::uint64_t allocations = 0;
+    std::uint64_t deallocations = 0;
+    std::uint64_t iterator_steps = 0;
+};
+
+// the live counts behind TreeStats; relaxed atomics, so threads reading one tree do not race
+struct TreeCounters {
+    std::atomic<std::uint64_t> comparisons{0};
+    std::atomic<std::uint64_t> nodes_visited{0};
+    std::atomic<std::uint64_t> allocations{0};
+    std::atomic<std::uint64_t> deallocations{0};
+    std::atomic<std::uint64_t> iterator_steps{0};
+
+    static void add(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    TreeStats snapshot() const {
+        return {
+            comparisons.load(std::memory_order_relaxed),
+            nodes_visited.load(std::memory_order_relaxed),
+            allocations.load(std::memory_order_relaxed),
+            deallocations.load(std::memory_order_relaxed),
+            iterator_steps.load(std::memory_order_relaxed)
+        };
+    }
+
+    void reset() {
+        for (auto* counter : { &comparisons, &nodes_visited, &allocations, &deallocations, &iterator_steps }) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+
+template <
+    typename T,
+    augmentTag Augment = no_augment_tag
+>
+struct Node : NodeAugment<Augment, Node<T, Augment>> {
+    static constexpr bool threaded = has_augment_v<Augment, threaded_tag>;
+    static constexpr bool instrumented = has_augment_v<Augment, instrumented_tag>;
+
+    // left unconstructed in the header node
+    union {
+        T value;
+    };
+    // colour for red_black_tag, subtree height for avl_tag
+    std::int8_t balance;
+    bool header;
     Node* par;
     Node* lhs;
     Node* rhs;
 
+    // the header of a tree: par is the root, lhs and rhs the leftmost and rightmost nodes,
+    // and the root's par points back here; an empty tree links the header to itself
+    Node()
+        : balance(1), header(true), par(nullptr), lhs(this), rhs(this) {
+        if constexpr (threaded) {
+            this->next = this->prev = this;
+        }
+    }
+
     Node(const T& value)
-        : value(value), par(nullptr), lhs(nullptr), rhs(nullptr) {
+        : value(value), balance(0), header(false), par(nullptr), lhs(nullptr), rhs(nullptr) {
+    }
+
+    Node(T&& value)
+        : value(std::move(value)), balance(0), header(false), par(nullptr), lhs(nullptr), rhs(nullptr) {
+    }
+
+    template <typename... Args>
+    explicit Node(std::in_place_t, Args&&... args)
+        : value(std::forward<Args>(args)...), balance(0), header(false), par(nullptr), lhs(nullptr), rhs(nullptr) {
+    }
+
+    ~Node() requires std::is_trivially_destructible_v<T> = default;
+
+    ~Node() {
+        if (!header) {
+            value.~T();
+        }
     }
 };
 
@@ -30,13 +212,48 @@ concept traversalTag = requires() {
 };
 
 
+// promises that a range is strictly increasing under the container's comparator
+struct sorted_unique_t {
+    explicit sorted_unique_t() = default;
+};
+inline constexpr sorted_unique_t sorted_unique{};
+
+
+struct no_balance_tag {};
+struct red_black_tag {};
+struct avl_tag {};
+
+// No rotations: an insert landing deeper than Num / Den * log2(size()) rebuilds, perfectly
+// balanced, the lowest subtree around it that breaks the same bound, and shrinking to half the
+// size rebuilds the whole tree. Amortized O(log n) per update, the rebuilds take linear time
+template <unsigned Num = 2, unsigned Den = 1>
+struct scapegoat_tag {
+    static_assert(Num > Den, "the depth bound needs a factor above 1");
+
+    static constexpr double depth_factor = double(Num) / Den;
+};
+
+
+template <typename T>
+inline constexpr bool is_scapegoat_v = false;
+
+template <unsigned Num, unsigned Den>
+inline constexpr bool is_scapegoat_v<scapegoat_tag<Num, Den>> = true;
+
+template <typename T>
+concept balanceTag = std::is_same_v<T, no_balance_tag> || std::is_same_v<T, red_black_tag> || std::is_same_v<T, avl_tag> ||
+    is_scapegoat_v<T>;
+
+
+// Threaded iterators follow the next/prev links, which the tree keeps in its own Tag order
 template<
     typename T, 
     traversalTag Tag,
-    typename node_t = Node<T>
+    typename node_t = Node<T>,
+    bool Threaded = node_t::threaded
 > 
 class TreeIterator {
-    template <typename, traversalTag, typename, typename>
+    template <typename, traversalTag, typename, typename, balanceTag, augmentTag>
     friend class SearchTree;
 public:
     using iterator_category = std::bidirectional_iterator_tag;
@@ -47,14 +264,24 @@ public:
 
     using node_type = node_t;
 
+private:
+    struct no_counters {};
+
+    static constexpr bool instrumented = node_t::instrumented;
+
 public:
-    TreeIterator() : node_(nullptr) {}
-    TreeIterator(node_t* node) : node_(node) {} 
+    TreeIterator() : node_(nullptr), counters_() {}
+    TreeIterator(node_t* node) : node_(node), counters_() {} 
+
+    // an instrumented tree hands out iterators that count their steps into the tree
+    TreeIterator(node_t* node, TreeCounters* counters)
+        requires instrumented
+        : node_(node), counters_(counters) {}
 
-    reference operator *() {
+    reference operator *() const {
         return node_->value;
     }
-    pointer operator ->() {
+    pointer operator ->() const {
         return &(node_->value);
     }
 
@@ -67,14 +294,8 @@ public:
 
 public:
     TreeIterator& operator ++() {
-        if (!node_) {
-            node_ = next_if_nullptr_;
-        }
-        else {
-            prev_if_nullptr_ = node_;
-            increase();
-        }
-        
+        increase();
+
         return *this;
     }
     TreeIterator operator ++(int) {
@@ -85,13 +306,7 @@ public:
     }
 
     TreeIterator& operator --() {
-        if (!node_) {
-            node_ = prev_if_nullptr_;
-        }
-        else {
-            next_if_nullptr_ = node_;
-            decrease();
-        }
+        decrease();
 
         return *this;
     }
@@ -103,11 +318,28 @@ public:
     }
 
 private:
-    TreeIterator(node_t* node, node_t* begin, node_t* end) 
-        : node_(node), next_if_nullptr_(begin), prev_if_nullptr_(end) {
-    }
-
+    // end() is the header, stepping past either end of the sequence lands on it and wraps around
     void increase() {
+        count_step();
+        if constexpr (Threaded) {
+            node_ = node_->next;
+            return;
+        }
+        if (node_->header) {
+            if (node_->par) {
+                if constexpr (std::is_same_v<Tag, in_order_tag>) {
+                    node_ = node_->lhs;
+                }
+                else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                    node_ = node_->par;
+                }
+                else if constexpr (std::is_same_v<Tag, post_order_tag>) {
+                    node_ = first_leaf(node_->lhs);
+                }
+            }
+            return;
+        }
+
         if constexpr (std::is_same_v<Tag, in_order_tag>) {
             if (node_->rhs != nullptr) {
                 node_ = node_->rhs;
@@ -117,7 +349,7 @@ private:
             }
             else {
                 node_t* parent = node_->par;
-                while (parent != nullptr && node_ == parent->rhs) {
+                while (!parent->header && node_ == parent->rhs) {
                     node_ = parent;
                     parent = parent->par;
                 }
@@ -133,25 +365,17 @@ private:
             }
             else {
                 node_t* parent = node_->par;
-                while (parent != nullptr && (node_ == parent->rhs || parent->rhs == nullptr)) {
+                while (!parent->header && (node_ == parent->rhs || parent->rhs == nullptr)) {
                     node_ = parent;
                     parent = parent->par;
                 }
-                node_ = parent != nullptr ? parent->rhs : nullptr;
+                node_ = parent->header ? parent : parent->rhs;
             }
         }
         else if constexpr (std::is_same_v<Tag, post_order_tag>) {
             node_t* parent = node_->par;
-            if (parent != nullptr && node_ == parent->lhs && parent->rhs != nullptr) {
-                node_ = parent->rhs;
-                while (node_->lhs != nullptr || node_->rhs != nullptr) {
-                    if (node_->lhs != nullptr) {
-                        node_ = node_->lhs;
-                    }
-                    else {
-                        node_ = node_->rhs;
-                    }
-                }
+            if (!parent->header && node_ == parent->lhs && parent->rhs != nullptr) {
+                node_ = first_leaf(parent->rhs);
             }
             else {
                 node_ = parent;
@@ -160,6 +384,26 @@ private:
     }
 
     void decrease() {
+        count_step();
+        if constexpr (Threaded) {
+            node_ = node_->prev;
+            return;
+        }
+        if (node_->header) {
+            if (node_->par) {
+                if constexpr (std::is_same_v<Tag, in_order_tag>) {
+                    node_ = node_->rhs;
+                }
+                else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                    node_ = last_leaf(node_->rhs);
+                }
+                else if constexpr (std::is_same_v<Tag, post_order_tag>) {
+                    node_ = node_->par;
+                }
+            }
+            return;
+        }
+
         if constexpr (std::is_same_v<Tag, in_order_tag>) {
             if (node_->lhs != nullptr) {
                 node_ = node_->lhs;
@@ -169,7 +413,7 @@ private:
             }
             else {
                 node_t* parent = node_->par;
-                while (parent != nullptr && node_ == parent->lhs) {
+                while (!parent->header && node_ == parent->lhs) {
                     node_ = parent;
                     parent = parent->par;
                 }
@@ -178,11 +422,8 @@ private:
         }
         else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
             node_t* parent = node_->par;
-            if (parent != nullptr && node_ == parent->rhs && parent->lhs != nullptr) {
-                node_ = parent->lhs;
-                while (node_->rhs != nullptr) {
-                    node_ = node_->rhs;
-                }
+            if (!parent->header && node_ == parent->rhs && parent->lhs != nullptr) {
+                node_ = last_leaf(parent->lhs);
             }
             else {
                 node_ = parent;
@@ -191,25 +432,51 @@ private:
         else if constexpr (std::is_same_v<Tag, post_order_tag>) {
             if (node_->rhs != nullptr) {
                 node_ = node_->rhs;
-                while (node_->lhs != nullptr) {
-                    node_ = node_->lhs;
-                }
+            }
+            else if (node_->lhs != nullptr) {
+                node_ = node_->lhs;
             }
             else {
                 node_t* parent = node_->par;
-                while (parent != nullptr && node_ == parent->lhs) {
+                while (!parent->header && (node_ == parent->lhs || parent->lhs == nullptr)) {
                     node_ = parent;
                     parent = parent->par;
                 }
-                node_ = parent;
+                node_ = parent->header ? parent : parent->lhs;
+            }
+        }
+    }
+
+    void count_step() {
+        if constexpr (instrumented) {
+            if (counters_) {
+                TreeCounters::add(counters_->iterator_steps);
             }
         }
     }
 
+    // first node of a subtree in post-order; from the leftmost node of a
+    // balanced tree this is at most one step
+    static node_t* first_leaf(node_t* node) {
+        while (node->lhs != nullptr || node->rhs != nullptr) {
+            node = node->lhs != nullptr ? node->lhs : node->rhs;
+        }
+
+        return node;
+    }
+
+    // last node of a subtree in pre-order, mirrors first_leaf
+    static node_t* last_leaf(node_t* node) {
+        while (node->lhs != nullptr || node->rhs != nullptr) {
+            node = node->rhs != nullptr ? node->rhs : node->lhs;
+        }
+
+        return node;
+    }
+
 private:
     node_t* node_;
-    node_t* prev_if_nullptr_ = nullptr;
-    node_t* next_if_nullptr_ = nullptr;
+    [[no_unique_address]] std::conditional_t<instrumented, TreeCounters*, no_counters> counters_;
 };
 
 
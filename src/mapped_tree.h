@@ -0,0 +1,110 @@
+#pragma once
+
+// memory mapping is POSIX only; elsewhere the header is empty and saved files go through load()
+#if __has_include(<sys/mman.h>)
+
+#include "frozen_tree.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Read-only view of a file written by FrozenView::save (or SearchTree::save). The file is mapped
+// and searched in place: nothing is read or copied up front, pages are faulted in as lookups and
+// iteration touch them, and mappings of the same file share the page cache.
+template <
+    typename T,
+    typename Comp = std::less<T>
+>
+class MappedTree : public FrozenView<T, Comp> {
+    static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable values can be mapped");
+private:
+    using view_type = FrozenView<T, Comp>;
+
+public:
+    // throws std::system_error if the file cannot be mapped, std::runtime_error if it is malformed
+    explicit MappedTree(const std::string& path, const Comp& comp = Comp())
+        : view_type(nullptr, 0, comp), mapping_(nullptr), length_(0) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "cannot stat " + path);
+        }
+        length_ = std::size_t(info.st_size);
+        if (length_ < FrozenFileHeader::size) {
+            ::close(fd);
+            throw std::runtime_error("truncated frozen tree file " + path);
+        }
+        void* mapping = ::mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::system_error(error, std::generic_category(), "cannot map " + path);
+        }
+        mapping_ = mapping;
+
+        FrozenFileHeader header;
+        std::memcpy(&header, mapping_, sizeof(header));
+        try {
+            header.check<T>();
+            if ((length_ - FrozenFileHeader::size) / sizeof(T) <= header.count) {
+                throw std::runtime_error("truncated frozen tree file " + path);
+            }
+        }
+        catch (...) {
+            ::munmap(mapping_, length_);
+            throw;
+        }
+        this->data_ = reinterpret_cast<const T*>(static_cast<const char*>(mapping_) + FrozenFileHeader::size);
+        this->size_ = header.count;
+    }
+
+    MappedTree(const MappedTree&) = delete;
+
+    MappedTree(MappedTree&& other) noexcept
+        : view_type(nullptr, 0, other.comp_), mapping_(nullptr), length_(0) {
+        swap(other);
+    }
+
+    MappedTree& operator =(MappedTree other) noexcept {
+        swap(other);
+
+        return *this;
+    }
+
+    ~MappedTree() {
+        if (mapping_) {
+            ::munmap(mapping_, length_);
+        }
+    }
+
+
+    void swap(MappedTree& other) noexcept {
+        view_type::swap(other);
+        std::swap(mapping_, other.mapping_);
+        std::swap(length_, other.length_);
+    }
+
+private:
+    void* mapping_;
+    std::size_t length_;
+};
+
+#endif
@@ -0,0 +1,605 @@
+#pragma once
+
+#include "iterator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Immutable node shared by every version that reaches it. refs counts the parents and trees
+// holding it; the count is atomic so versions can be handed to other threads.
+template <typename T>
+struct PersistentNode {
+    T value;
+    // subtree height, the tree is kept AVL balanced
+    std::int8_t height;
+    mutable std::atomic<std::size_t> refs;
+    const PersistentNode* lhs;
+    const PersistentNode* rhs;
+
+    template <typename value_t>
+    PersistentNode(value_t&& value, const PersistentNode* lhs, const PersistentNode* rhs)
+        : value(std::forward<value_t>(value)),
+          height(1 + std::max(lhs ? lhs->height : 0, rhs ? rhs->height : 0)),
+          refs(1), lhs(lhs), rhs(rhs) {
+    }
+};
+
+
+// Nodes have no parent links since they are shared, so the iterator keeps the path from the
+// root; the path is at most ~1.44 log2(n) long. It stays valid while its version is alive.
+template <
+    typename T,
+    traversalTag Tag,
+    typename node_t = PersistentNode<T>
+>
+class PersistentIterator {
+    template <typename, traversalTag, typename>
+    friend class PersistentSearchTree;
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+public:
+    PersistentIterator() : root_(nullptr) {}
+
+    reference operator *() const {
+        return path_.back()->value;
+    }
+    pointer operator ->() const {
+        return &path_.back()->value;
+    }
+
+    bool operator ==(const PersistentIterator& arg) const {
+        return node() == arg.node();
+    }
+    bool operator !=(const PersistentIterator& arg) const {
+        return node() != arg.node();
+    }
+
+    PersistentIterator& operator ++() {
+        increase();
+
+        return *this;
+    }
+    PersistentIterator operator ++(int) {
+        PersistentIterator temp = *this;
+        increase();
+
+        return temp;
+    }
+
+    PersistentIterator& operator --() {
+        decrease();
+
+        return *this;
+    }
+    PersistentIterator operator --(int) {
+        PersistentIterator temp = *this;
+        decrease();
+
+        return temp;
+    }
+
+private:
+    explicit PersistentIterator(const node_t* root)
+        : root_(root) {
+    }
+
+    PersistentIterator(const node_t* root, std::vector<const node_t*> path)
+        : root_(root), path_(std::move(path)) {
+    }
+
+    const node_t* node() const {
+        return path_.empty() ? nullptr : path_.back();
+    }
+
+    // pushes the way down from node, preferring lhs (to the first leaf) or rhs (to the last one)
+    void descend(const node_t* node, bool left, bool leaf) {
+        while (node) {
+            path_.push_back(node);
+            const node_t* near = left ? node->lhs : node->rhs;
+            const node_t* far = left ? node->rhs : node->lhs;
+            node = near ? near : (leaf ? far : nullptr);
+        }
+    }
+
+    // pops the finished subtree; stops once the top was reached from its stop_side child,
+    // or from a child with no sibling on the other side if skip_lone is set
+    const node_t* climb(bool from_left, bool skip_lone) {
+        const node_t* child = path_.back();
+        path_.pop_back();
+        while (!path_.empty()) {
+            const node_t* par = path_.back();
+            const node_t* side = from_left ? par->lhs : par->rhs;
+            const node_t* other = from_left ? par->rhs : par->lhs;
+            if (side == child && (!skip_lone || other)) {
+                break;
+            }
+            child = par;
+            path_.pop_back();
+        }
+
+        return child;
+    }
+
+    // end() has an empty path, stepping past either end lands there and wraps around
+    void increase() {
+        if (path_.empty()) {
+            if constexpr (std::is_same_v<Tag, in_order_tag>) {
+                descend(root_, true, false);
+            }
+            else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                if (root_) {
+                    path_.push_back(root_);
+                }
+            }
+            else {
+                descend(root_, true, true);
+            }
+            return;
+        }
+
+        const node_t* node = path_.back();
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            if (node->rhs) {
+                path_.push_back(node->rhs);
+                descend(node->rhs->lhs, true, false);
+            }
+            else {
+                climb(true, false);
+            }
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            if (node->lhs || node->rhs) {
+                path_.push_back(node->lhs ? node->lhs : node->rhs);
+            }
+            else {
+                climb(true, true);
+                if (!path_.empty()) {
+                    path_.push_back(path_.back()->rhs);
+                }
+            }
+        }
+        else {
+            path_.pop_back();
+            if (!path_.empty() && path_.back()->lhs == node && path_.back()->rhs) {
+                descend(path_.back()->rhs, true, true);
+            }
+        }
+    }
+
+    void decrease() {
+        if (path_.empty()) {
+            if constexpr (std::is_same_v<Tag, in_order_tag>) {
+                descend(root_, false, false);
+            }
+            else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                descend(root_, false, true);
+            }
+            else {
+                if (root_) {
+                    path_.push_back(root_);
+                }
+            }
+            return;
+        }
+
+        const node_t* node = path_.back();
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            if (node->lhs) {
+                path_.push_back(node->lhs);
+                descend(node->lhs->rhs, false, false);
+            }
+            else {
+                climb(false, false);
+            }
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            path_.pop_back();
+            if (!path_.empty() && path_.back()->rhs == node && path_.back()->lhs) {
+                descend(path_.back()->lhs, false, true);
+            }
+        }
+        else {
+            if (node->lhs || node->rhs) {
+                path_.push_back(node->rhs ? node->rhs : node->lhs);
+            }
+            else {
+                climb(false, true);
+                if (!path_.empty()) {
+                    path_.push_back(path_.back()->lhs);
+                }
+            }
+        }
+    }
+
+private:
+    const node_t* root_;
+    std::vector<const node_t*> path_;
+};
+
+
+// Persistent ordered set: nodes are never modified, insert and erase copy only the O(log n)
+// nodes on the search path and share everything else with older versions, so copying a
+// tree (snapshot()) is O(1) and old versions stay readable for as long as they are kept.
+template <
+    typename T,
+    traversalTag Tag,
+    typename Comp = std::less<T>
+>
+class PersistentSearchTree {
+private:
+    using node_t = PersistentNode<T>;
+
+public:
+    using value_type = T;
+    using reference = const value_type&;
+    using const_reference = const value_type&;
+    using iterator = PersistentIterator<T, Tag, node_t>;
+    using const_iterator = PersistentIterator<T, Tag, node_t>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+    using difference_type = std::ptrdiff_t;
+    using size_type = std::size_t;
+
+    using key_type = T;
+    using key_compare = Comp;
+    using value_compare = Comp;
+
+public:
+    PersistentSearchTree()
+        : root_(nullptr), comp_(Comp()), size_(0) {}
+
+    explicit PersistentSearchTree(const Comp& comp)
+        : root_(nullptr), comp_(comp), size_(0) {}
+
+    PersistentSearchTree(const PersistentSearchTree& other)
+        : root_(retain(other.root_)), comp_(other.comp_), size_(other.size_) {}
+
+    PersistentSearchTree(PersistentSearchTree&& other) noexcept
+        : root_(other.root_), comp_(other.comp_), size_(other.size_) {
+        other.root_ = nullptr;
+        other.size_ = 0;
+    }
+
+    PersistentSearchTree& operator =(PersistentSearchTree other) {
+        swap(other);
+
+        return *this;
+    }
+
+    ~PersistentSearchTree() {
+        release(root_);
+    }
+
+
+    // O(1): the version shares every node with this tree and is unaffected by later changes
+    PersistentSearchTree snapshot() const {
+        return *this;
+    }
+
+
+    iterator begin() const {
+        return ++end();
+    }
+
+    iterator end() const {
+        return iterator(root_);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    reverse_iterator rbegin() const {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const {
+        return reverse_iterator(begin());
+    }
+
+
+    void swap(PersistentSearchTree& other) noexcept {
+        std::swap(root_, other.root_);
+        std::swap(comp_, other.comp_);
+        std::swap(size_, other.size_);
+    }
+
+    size_type size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    key_compare key_comp() const {
+        return comp_;
+    }
+
+    void clear() {
+        release(root_);
+        root_ = nullptr;
+        size_ = 0;
+    }
+
+
+    bool insert(const value_type& value) {
+        return replace_root(insert_path(root_, value), 1);
+    }
+
+    bool insert(value_type&& value) {
+        return replace_root(insert_path(root_, std::move(value)), 1);
+    }
+
+    size_type erase(const value_type& value) {
+        return replace_root(erase_path(root_, value), -1);
+    }
+
+
+    bool contains(const value_type& value) const {
+        const node_t* node = root_;
+        while (node) {
+            if (comp_(value, node->value)) {
+                node = node->lhs;
+            }
+            else if (comp_(node->value, value)) {
+                node = node->rhs;
+            }
+            else {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // the iterator starts at the found node whatever the Tag, like SearchTree::find
+    const_iterator find(const value_type& value) const {
+        std::vector<const node_t*> path;
+        const node_t* node = root_;
+        while (node) {
+            path.push_back(node);
+            if (comp_(value, node->value)) {
+                node = node->lhs;
+            }
+            else if (comp_(node->value, value)) {
+                node = node->rhs;
+            }
+            else {
+                return const_iterator(root_, std::move(path));
+            }
+        }
+
+        return end();
+    }
+
+    const_iterator lower_bound(const value_type& value) const {
+        std::vector<const node_t*> path;
+        std::size_t found = 0;
+        const node_t* node = root_;
+        while (node) {
+            path.push_back(node);
+            if (comp_(node->value, value)) {
+                node = node->rhs;
+            }
+            else {
+                found = path.size();
+                node = node->lhs;
+            }
+        }
+        path.resize(found);
+
+        return const_iterator(root_, std::move(path));
+    }
+
+private:
+    // a subtree built by a path copy; changed is false when the value was there (or missing
+    // for erase), nothing is allocated then and node is meaningless
+    struct path_result {
+        const node_t* node;
+        bool changed;
+    };
+
+
+    bool replace_root(path_result res, int delta) {
+        if (!res.changed) {
+            return false;
+        }
+        release(root_);
+        root_ = res.node;
+        size_ += delta;
+
+        return true;
+    }
+
+
+    static const node_t* retain(const node_t* node) {
+        if (node) {
+            node->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        return node;
+    }
+
+
+    // recursion depth is bounded by the height of a balanced tree
+    static void release(const node_t* node) {
+        if (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release(node->lhs);
+            release(node->rhs);
+            delete node;
+        }
+    }
+
+
+    static int height(const node_t* node) {
+        return node ? node->height : 0;
+    }
+
+
+    // new node over two subtrees whose references it takes over
+    template <typename value_t>
+    static const node_t* make(value_t&& value, const node_t* lhs, const node_t* rhs) {
+        try {
+            return new node_t(std::forward<value_t>(value), lhs, rhs);
+        }
+        catch (...) {
+            release(lhs);
+            release(rhs);
+            throw;
+        }
+    }
+
+
+    // make() that restores the AVL property with at most two rotations; the rotated child
+    // is taken apart, its own children are retained and the child itself released. Every new
+    // node is built on its own, so a throwing copy or allocation releases exactly what was taken
+    template <typename value_t>
+    static const node_t* balance(value_t&& value, const node_t* lhs, const node_t* rhs) {
+        if (height(lhs) > height(rhs) + 1) {
+            const node_t* ll = lhs->lhs;
+            const node_t* lr = lhs->rhs;
+            const node_t* low = nullptr;
+            const node_t* res;
+            try {
+                if (height(ll) >= height(lr)) {
+                    const node_t* high = make(std::forward<value_t>(value), retain(lr), std::exchange(rhs, nullptr));
+                    res = make(lhs->value, retain(ll), high);
+                }
+                else {
+                    low = make(lhs->value, retain(ll), retain(lr->lhs));
+                    const node_t* high = make(std::forward<value_t>(value), retain(lr->rhs), std::exchange(rhs, nullptr));
+                    res = make(lr->value, std::exchange(low, nullptr), high);
+                }
+            }
+            catch (...) {
+                release(low);
+                release(rhs);
+                release(lhs);
+                throw;
+            }
+            release(lhs);
+
+            return res;
+        }
+        if (height(rhs) > height(lhs) + 1) {
+            const node_t* rr = rhs->rhs;
+            const node_t* rl = rhs->lhs;
+            const node_t* high = nullptr;
+            const node_t* res;
+            try {
+                if (height(rr) >= height(rl)) {
+                    const node_t* low = make(std::forward<value_t>(value), std::exchange(lhs, nullptr), retain(rl));
+                    res = make(rhs->value, low, retain(rr));
+                }
+                else {
+                    high = make(rhs->value, retain(rl->rhs), retain(rr));
+                    const node_t* low = make(std::forward<value_t>(value), std::exchange(lhs, nullptr), retain(rl->lhs));
+                    res = make(rl->value, low, std::exchange(high, nullptr));
+                }
+            }
+            catch (...) {
+                release(high);
+                release(lhs);
+                release(rhs);
+                throw;
+            }
+            release(rhs);
+
+            return res;
+        }
+
+        return make(std::forward<value_t>(value), lhs, rhs);
+    }
+
+
+    template <typename value_t>
+    path_result insert_path(const node_t* node, value_t&& value) {
+        if (!node) {
+            return { make(std::forward<value_t>(value), nullptr, nullptr), true };
+        }
+        if (comp_(value, node->value)) {
+            path_result lhs = insert_path(node->lhs, std::forward<value_t>(value));
+            if (!lhs.changed) {
+                return lhs;
+            }
+
+            return { balance(node->value, lhs.node, retain(node->rhs)), true };
+        }
+        if (comp_(node->value, value)) {
+            path_result rhs = insert_path(node->rhs, std::forward<value_t>(value));
+            if (!rhs.changed) {
+                return rhs;
+            }
+
+            return { balance(node->value, retain(node->lhs), rhs.node), true };
+        }
+
+        return { nullptr, false };
+    }
+
+
+    // the smallest value moves up into the erased node's place
+    path_result erase_path(const node_t* node, const value_type& value) {
+        if (!node) {
+            return { nullptr, false };
+        }
+        if (comp_(value, node->value)) {
+            path_result lhs = erase_path(node->lhs, value);
+            if (!lhs.changed) {
+                return lhs;
+            }
+
+            return { balance(node->value, lhs.node, retain(node->rhs)), true };
+        }
+        if (comp_(node->value, value)) {
+            path_result rhs = erase_path(node->rhs, value);
+            if (!rhs.changed) {
+                return rhs;
+            }
+
+            return { balance(node->value, retain(node->lhs), rhs.node), true };
+        }
+
+        if (!node->lhs || !node->rhs) {
+            return { retain(node->lhs ? node->lhs : node->rhs), true };
+        }
+        const node_t* min = node->rhs;
+        while (min->lhs) {
+            min = min->lhs;
+        }
+
+        return { balance(min->value, retain(node->lhs), erase_min(node->rhs)), true };
+    }
+
+
+    static const node_t* erase_min(const node_t* node) {
+        if (!node->lhs) {
+            return retain(node->rhs);
+        }
+
+        return balance(node->value, erase_min(node->lhs), retain(node->rhs));
+    }
+
+private:
+    const node_t* root_;
+    key_compare comp_;
+    size_type size_;
+};
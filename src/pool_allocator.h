@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// What all copies and rebound copies of one PoolAllocator share: a pool of fixed size slots
+// per node type, a free slot holds the link to the next one
+class PoolArena {
+    static constexpr std::size_t min_chunk_ = 64;
+    static constexpr std::size_t max_chunk_ = std::size_t(1) << 16;
+
+public:
+    class Pool {
+    public:
+        Pool(std::size_t slot_size, std::size_t alignment)
+            : slot_size_(std::max(slot_size, sizeof(void*))), alignment_(std::max(alignment, alignof(void*))) {}
+
+        Pool(const Pool&) = delete;
+        Pool& operator =(const Pool&) = delete;
+
+        ~Pool() {
+            release();
+        }
+
+        bool serves(std::size_t slot_size, std::size_t alignment) const {
+            return slot_size_ == std::max(slot_size, sizeof(void*)) && alignment_ == std::max(alignment, alignof(void*));
+        }
+
+        void* acquire() {
+            if (free_list_) {
+                void* slot = free_list_;
+                free_list_ = *static_cast<void**>(slot);
+                return slot;
+            }
+            if (cursor_ == chunk_end_) {
+                grow();
+            }
+            void* slot = cursor_;
+            cursor_ += slot_size_;
+
+            return slot;
+        }
+
+        void recycle(void* slot) {
+            *static_cast<void**>(slot) = free_list_;
+            free_list_ = slot;
+        }
+
+        void release() {
+            for (void* chunk : chunks_) {
+                ::operator delete(chunk, std::align_val_t(alignment_));
+            }
+            chunks_.clear();
+            free_list_ = nullptr;
+            cursor_ = chunk_end_ = nullptr;
+            next_chunk_ = min_chunk_;
+        }
+
+        std::size_t chunk_count() const {
+            return chunks_.size();
+        }
+
+    private:
+        void grow() {
+            std::size_t bytes = next_chunk_ * slot_size_;
+            void* chunk = ::operator new(bytes, std::align_val_t(alignment_));
+            chunks_.push_back(chunk);
+            cursor_ = static_cast<unsigned char*>(chunk);
+            chunk_end_ = cursor_ + bytes;
+            next_chunk_ = std::min(next_chunk_ * 2, max_chunk_);
+        }
+
+    private:
+        std::size_t slot_size_;
+        std::size_t alignment_;
+        void* free_list_ = nullptr;
+        unsigned char* cursor_ = nullptr;
+        unsigned char* chunk_end_ = nullptr;
+        std::size_t next_chunk_ = min_chunk_;
+        std::vector<void*> chunks_;
+    };
+
+
+    Pool& pool(std::size_t slot_size, std::size_t alignment) {
+        for (const std::unique_ptr<Pool>& pool : pools_) {
+            if (pool->serves(slot_size, alignment)) {
+                return *pool;
+            }
+        }
+
+        return *pools_.emplace_back(std::make_unique<Pool>(slot_size, alignment));
+    }
+
+    void release() {
+        for (const std::unique_ptr<Pool>& pool : pools_) {
+            pool->release();
+        }
+    }
+
+    std::size_t chunk_count() const {
+        std::size_t res = 0;
+        for (const std::unique_ptr<Pool>& pool : pools_) {
+            res += pool->chunk_count();
+        }
+
+        return res;
+    }
+
+private:
+    // a handful of node types at most, so a scan beats a map
+    std::vector<std::unique_ptr<Pool>> pools_;
+};
+
+
+// Slab allocator for single objects of type T (tree nodes). Freed slots go to a
+// free list and are reused, chunks are returned to the system all at once by
+// release() or when the last copy of the allocator goes away. Copies and rebound
+// copies share one arena with a pool per slot size, so they compare equal and any
+// of them frees what another allocated; trees only exchange nodes (merge, node
+// handles) when their allocators are equal, i.e. draw from the same arena. A copied
+// tree gets an arena of its own (select_on_container_copy_construction), as does a
+// default constructed one: merging such trees or moving node handles between them
+// is not allowed, the nodes would be freed into the wrong arena.
+template <typename T>
+class PoolAllocator {
+    template <typename>
+    friend class PoolAllocator;
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    PoolAllocator()
+        : PoolAllocator(std::make_shared<PoolArena>()) {}
+
+    PoolAllocator(const PoolAllocator& other) = default;
+
+    // shares the arena, allocate() uses its pool for the slot size of T
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other)
+        : PoolAllocator(other.arena_) {}
+
+    PoolAllocator& operator =(const PoolAllocator& other) = default;
+
+    PoolAllocator select_on_container_copy_construction() const {
+        return PoolAllocator();
+    }
+
+
+    T* allocate(size_type n) {
+        if (n != 1) {
+            return std::allocator<T>().allocate(n);
+        }
+
+        return static_cast<T*>(pool_->acquire());
+    }
+
+    void deallocate(T* ptr, size_type n) {
+        if (n != 1) {
+            std::allocator<T>().deallocate(ptr, n);
+            return;
+        }
+        pool_->recycle(ptr);
+    }
+
+    // frees every chunk of the arena at once, all objects taken from it become invalid
+    void release() {
+        arena_->release();
+    }
+
+    bool exclusive() const {
+        return arena_.use_count() == 1;
+    }
+
+    size_type chunk_count() const {
+        return arena_->chunk_count();
+    }
+
+
+    template <typename U>
+    bool operator ==(const PoolAllocator<U>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template <typename U>
+    bool operator !=(const PoolAllocator<U>& other) const {
+        return !operator==(other);
+    }
+
+private:
+    explicit PoolAllocator(std::shared_ptr<PoolArena> arena)
+        : arena_(std::move(arena)), pool_(&arena_->pool(sizeof(T), alignof(T))) {}
+
+private:
+    std::shared_ptr<PoolArena> arena_;
+    PoolArena::Pool* pool_;
+};
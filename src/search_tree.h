@@ -1,18 +1,157 @@
 #pragma once
 
 #include "iterator.h"
+#include "frozen_tree.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <concepts>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <vector>
+
+
+
+template <typename A>
+concept bulkReleasable = requires(A alloc) {
+    alloc.release();
+    { alloc.exclusive() } -> std::convertible_to<bool>;
+};
+
+// comparators that accept keys of other types, like std::less<>
+template <typename C>
+concept transparentComparator = requires {
+    typename C::is_transparent;
+};
+
+
+// owns a node taken out of a tree until it is inserted again or destroyed
+template <
+    typename node_t,
+    typename Allocator
+>
+class NodeHandle {
+    template <typename, traversalTag, typename, typename, balanceTag, augmentTag>
+    friend class SearchTree;
+public:
+    using value_type = decltype(node_t::value);
+    using allocator_type = Allocator;
+
+private:
+    using allocator_traits_type = std::allocator_traits<allocator_type>;
+
+public:
+    NodeHandle() = default;
+
+    NodeHandle(NodeHandle&& other) noexcept
+        : node_(other.node_), alloc_(std::move(other.alloc_)) {
+        other.node_ = nullptr;
+        other.alloc_.reset();
+    }
+
+    NodeHandle& operator =(NodeHandle&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        reset();
+        node_ = other.node_;
+        alloc_ = std::move(other.alloc_);
+        other.node_ = nullptr;
+        other.alloc_.reset();
+
+        return *this;
+    }
+
+    ~NodeHandle() {
+        reset();
+    }
+
+    bool empty() const {
+        return node_ == nullptr;
+    }
+
+    explicit operator bool() const {
+        return node_ != nullptr;
+    }
+
+    value_type& value() const {
+        return node_->value;
+    }
 
+    allocator_type get_allocator() const {
+        return *alloc_;
+    }
+
+    void swap(NodeHandle& other) noexcept {
+        std::swap(node_, other.node_);
+        std::swap(alloc_, other.alloc_);
+    }
+
+private:
+    NodeHandle(node_t* node, const allocator_type& alloc)
+        : node_(node), alloc_(alloc) {
+    }
+
+    node_t* release() {
+        node_t* node = node_;
+        node_ = nullptr;
+        alloc_.reset();
+
+        return node;
+    }
+
+    void reset() {
+        if (node_) {
+            allocator_traits_type::destroy(*alloc_, node_);
+            allocator_traits_type::deallocate(*alloc_, node_, 1);
+            node_ = nullptr;
+        }
+        alloc_.reset();
+    }
+
+private:
+    node_t* node_ = nullptr;
+    std::optional<allocator_type> alloc_;
+};
 
 
 template <
     typename T,
     traversalTag Tag,
     typename Comp = std::less<T>,
-    typename Allocator = std::allocator<Node<T>>
+    typename Allocator = std::allocator<Node<T>>,
+    balanceTag Balance = no_balance_tag,
+    augmentTag Augment = no_augment_tag
 >
 class SearchTree {
+    template <typename, traversalTag, typename, typename, balanceTag, augmentTag>
+    friend class SearchTree;
 private:
-    using node_t = Node<T>;
+    using node_t = Node<T, Augment>;
+    // Allocator is rebound, so std::allocator<Node<T>> also serves augmented nodes
+    using node_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<node_t>;
+
+    static constexpr bool order_statistics = has_augment_v<Augment, order_statistics_tag>;
+    using aggregate_monoid = aggregate_monoid_t<Augment>;
+    static constexpr bool aggregated = !std::is_void_v<aggregate_monoid>;
+    static_assert(!aggregated || aggregateMonoid<aggregate_monoid, T>,
+        "range_aggregate needs a Monoid with value_type, identity(), lift(const T&) and combine()");
+    static constexpr bool threaded = node_t::threaded;
+    static constexpr bool instrumented = node_t::instrumented;
+    static constexpr bool scapegoat = is_scapegoat_v<Balance>;
+    // the balance policies split, join and the set algebra can rely on
+    static constexpr bool rank_balanced = std::is_same_v<Balance, red_black_tag> || std::is_same_v<Balance, avl_tag>;
+
+    // stands in for a member a policy does not use, one type per member so that none takes space
+    template <typename member_t>
+    struct unused {};
 public:
     using value_type = T;
     using reference = value_type&;
@@ -24,7 +163,13 @@ public:
     using difference_type = std::ptrdiff_t;
     using size_type = std::size_t;
 
-    using node_type = iterator::node_type;
+    using node_type = NodeHandle<node_t, node_allocator_type>;
+
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
 
     using key_type = T;
     using key_compare = Comp;
@@ -34,30 +179,63 @@ public:
     using const_reverse_iterator = std::reverse_iterator<const_iterator>;
 
     using allocator_type = Allocator;
-    using allocator_traits_type = std::allocator_traits<allocator_type>;
+    using allocator_traits_type = std::allocator_traits<node_allocator_type>;
 
 private:
     using internal_iterator = TreeIterator<T, Tag, node_t>;
     size_type max_size_ = allocator_traits_type::max_size(alloc_);
 
+    static constexpr std::int8_t red = 0;
+    static constexpr std::int8_t black = 1;
+
+    static constexpr std::size_t batch_width = 16;
+
 private:
-    node_t* head_;
+    node_t header_;
     key_compare comp_;
-    allocator_type alloc_;
+    node_allocator_type alloc_;
     size_type size_;
+    // on the heap, so it moves and swaps along with the nodes and the iterators pointing into it stay
+    // valid; copies start from zero, a moved-from tree has none and counts nothing
+    [[no_unique_address]] std::conditional_t<instrumented, std::shared_ptr<TreeCounters>, unused<TreeCounters>> counters_ =
+        make_counters();
+    // largest size since the last full rebuild of a scapegoat tree
+    [[no_unique_address]] std::conditional_t<scapegoat, size_type, unused<size_type>> peak_size_ = {};
 
 public:
     SearchTree() 
-        : head_(nullptr), comp_(Comp()), alloc_(Allocator()), size_(0) {}
+        : header_(), comp_(Comp()), alloc_(Allocator()), size_(0) {}
+
+    explicit SearchTree(const Allocator& alloc)
+        : header_(), comp_(Comp()), alloc_(alloc), size_(0) {}
+
+    template <
+        std::input_iterator input_iter_t
+    >
+    SearchTree(input_iter_t lhs, input_iter_t rhs)
+        : SearchTree() {
+        insert(lhs, rhs);
+    }
+
+    template <
+        std::input_iterator input_iter_t
+    >
+    SearchTree(sorted_unique_t, input_iter_t lhs, input_iter_t rhs)
+        : SearchTree() {
+        insert(sorted_unique, lhs, rhs);
+    }
 
     SearchTree(const SearchTree& other) 
-        : head_(nullptr), comp_(other.comp_), alloc_(other.alloc_), size_(other.size_) {
-        copy(other.head_, head_);
+        : header_(), comp_(other.comp_),
+          alloc_(allocator_traits_type::select_on_container_copy_construction(other.alloc_)), size_(other.size_) {
+        copy(other.header_.par, header_.par, &header_);
+        reset_header(header_.par);
+        peak_size_ = other.peak_size_;
     }
 
     SearchTree(SearchTree&& other) noexcept 
-        : head_(other.head_), comp_(other.comp_), alloc_(other.alloc_), size_(other.size_) {
-        other.head_ = nullptr;
+        : header_(), comp_(other.comp_), alloc_(other.alloc_), size_(other.size_), counters_() {
+        swap_header(other);
         other.size_ = 0;
     }
 
@@ -65,11 +243,17 @@ public:
         if (this == &other) {
             return *this;
         }
-        delete_tree(&head_);
-        copy(other.head_, head_);
+        release_nodes();
+        // left empty, not stale, if a value copy below throws
+        size_ = 0;
+        if constexpr (allocator_traits_type::propagate_on_container_copy_assignment::value) {
+            alloc_ = other.alloc_;
+        }
+        copy(other.header_.par, header_.par, &header_);
+        reset_header(header_.par);
         comp_ = other.comp_;
-        alloc_ = other.alloc_;
         size_ = other.size_;
+        peak_size_ = other.peak_size_;
 
         return *this;
     }
@@ -78,65 +262,36 @@ public:
         if (this == &other) {
             return *this;
         }
-        delete_tree(&head_);
-        head_ = other.head_;
+        release_nodes();
+        swap_header(other);
         comp_ = other.comp_;
         alloc_ = other.alloc_;
         size_ = other.size_;
 
-        other.head_ = nullptr;
         other.size_ = 0;
 
         return *this;
     }
 
     ~SearchTree() {
-        delete_tree(head_);
+        release_nodes();
     }
 
 
     iterator begin() {
-        if constexpr (std::is_same_v<Tag, pre_order_tag>) {
-            return iterator(head_);
-        }
-        else {
-            auto [node, par] = find_left(head_, nullptr);
-
-            return iterator(node);
-        }
+        return make_iterator(first_node());
     }
 
     iterator end() {
-        if constexpr (std::is_same_v<Tag, post_order_tag>) {
-            return iterator(nullptr, nullptr, head_);
-        }
-        else {
-            auto [node, par] = find_right(head_, nullptr);
-
-            return iterator(nullptr, nullptr, node);
-        }
+        return make_iterator(end_node());
     }
 
     const_iterator cbegin() const {
-        if constexpr (std::is_same_v<Tag, pre_order_tag>) {
-            return const_iterator(head_);
-        }
-        else {
-            auto [node, par] = find_left(head_, nullptr);
-
-            return const_iterator(node);
-        }
+        return make_iterator(first_node());
     }
 
     const_iterator cend() const {
-        if constexpr (std::is_same_v<Tag, post_order_tag>) {
-            return const_iterator(nullptr, nullptr, head_);
-        }
-        else {
-            auto [node, par] = find_right(head_, nullptr);
-
-            return const_iterator(nullptr, nullptr, node);
-        }
+        return make_iterator(end_node());
     }
 
 
@@ -166,7 +321,7 @@ public:
 
 
     void swap(SearchTree& other) {
-        std::swap(head_, other.head_);
+        swap_header(other);
         std::swap(comp_, other.comp_);
         std::swap(alloc_, other.alloc_);
         std::swap(size_, other.size_);
@@ -199,105 +354,377 @@ public:
 
 
     std::pair<iterator, bool> insert(const value_type& value) {
-        auto [result, par] = smart_find(head_, nullptr, value);
-        std::pair<iterator, bool> out;
-        if (!result) {
-            result = create_node(value, par);
-            out = {iterator(result), true};
-            ++size_;
+        return insert_unique(value);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return insert_unique(std::move(value));
+    }
+
+    // links value right before hint (or after its in-order neighbour) when that keeps the order,
+    // otherwise falls back to a search from the root
+    iterator insert(const_iterator hint, const value_type& value) {
+        return insert_hint_unique(hint, value);
+    }
+
+    iterator insert(const_iterator hint, value_type&& value) {
+        return insert_hint_unique(hint, std::move(value));
+    }
+
+    insert_return_type insert(node_type&& handle) {
+        if (handle.empty()) {
+            return { end(), false, node_type() };
         }
-        else {
-            out = {iterator(result), false};
+        // the node goes back to alloc_ once erased
+        assert(handle.get_allocator() == alloc_);
+        auto [slot, par] = smart_find(header_.par, &header_, handle.value());
+        if (slot) {
+            return { make_iterator(slot), false, std::move(handle) };
         }
 
-        return out;
+        return { make_iterator(link_node(slot, par, handle.release())), true, node_type() };
     }
 
-    std::pair<iterator, bool> insert(value_type&& value) {
-        value_type lvalue_value = value;
-        return insert(lvalue_value);
+    iterator insert(const_iterator hint, node_type&& handle) {
+        if (handle.empty()) {
+            return end();
+        }
+        assert(handle.get_allocator() == alloc_);
+        auto [node, inserted] = insert_node(hint.node_, handle.node_);
+        if (inserted) {
+            handle.release();
+        }
+
+        return make_iterator(node);
+    }
+
+    // the value is constructed once inside its node, the node is dropped again on a duplicate
+    template <
+        typename... Args
+    >
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        node_t* node = create_node(nullptr, std::forward<Args>(args)...);
+        auto [slot, par] = smart_find(header_.par, &header_, node->value);
+        if (slot) {
+            destroy_node(node);
+            return { make_iterator(slot), false };
+        }
+
+        return { make_iterator(link_node(slot, par, node)), true };
     }
 
-    iterator insert(const_iterator hint, const value_type& value) = delete;
-    iterator insert(const_iterator hint, value_type&& value) = delete;
+    template <
+        typename... Args
+    >
+    iterator emplace_hint(const_iterator hint, Args&&... args) {
+        node_t* node = create_node(nullptr, std::forward<Args>(args)...);
+        auto [pos, inserted] = insert_node(hint.node_, node);
+        if (!inserted) {
+            destroy_node(node);
+        }
+
+        return make_iterator(pos);
+    }
     template <
         typename input_iter_t
     >
     void insert(input_iter_t lhs, input_iter_t rhs) {
+        if constexpr (std::forward_iterator<input_iter_t>) {
+            auto not_increasing = [this](const value_type& a, const value_type& b) { return !comp_(a, b); };
+            if (std::adjacent_find(lhs, rhs, not_increasing) == rhs) {
+                size_type count = std::distance(lhs, rhs);
+                if (count * std::bit_width(size_) >= size_) {
+                    insert(sorted_unique, lhs, rhs);
+                    return;
+                }
+            }
+        }
         while (lhs != rhs) {
             insert(*lhs);
             ++lhs;
         }
     }
 
+    // linear time: builds a perfectly balanced tree, merging with the current contents if any.
+    // Single-pass input into an empty tree, e.g. a stream, is linked as it is read and never buffered
+    template <
+        typename input_iter_t
+    >
+    void insert(sorted_unique_t, input_iter_t lhs, input_iter_t rhs) {
+        if constexpr (!std::forward_iterator<input_iter_t>) {
+            if (!header_.par) {
+                build_streaming(lhs, rhs);
+                return;
+            }
+        }
+
+        // the tree is only touched once every value is copied; if a copy throws, the nodes made
+        // so far, the ones without a parent, are destroyed again
+        std::vector<node_t*> nodes;
+        try {
+            if (!header_.par) {
+                nodes.reserve(std::distance(lhs, rhs));
+                for (; lhs != rhs; ++lhs) {
+                    nodes.push_back(create_node(nullptr, *lhs));
+                }
+            }
+            else {
+                nodes.reserve(size_);
+                node_t* cur = find_left(header_.par, nullptr).first;
+                for (; lhs != rhs; ++lhs) {
+                    const value_type& value = *lhs;
+                    while (cur && comp_(cur->value, value)) {
+                        nodes.push_back(cur);
+                        cur = in_order_next(cur);
+                    }
+                    if (!cur || comp_(value, cur->value)) {
+                        nodes.push_back(create_node(nullptr, value));
+                    }
+                }
+                for (; cur; cur = in_order_next(cur)) {
+                    nodes.push_back(cur);
+                }
+            }
+        }
+        catch (...) {
+            for (node_t* node : nodes) {
+                if (!node->par) {
+                    destroy_node(node);
+                }
+            }
+            throw;
+        }
+
+        auto next_node = [&nodes, pos = size_type(0)]() mutable {
+            return nodes[pos++];
+        };
+        reset_header(build_balanced(next_node, nodes.size(), &header_, 0, red_depth(nodes.size())));
+        size_ = nodes.size();
+    }
+
     size_type erase(const value_type& value) {
-        auto [node, par] = smart_find(head_, nullptr, value);
+        auto [node, par] = smart_find(header_.par, &header_, value);
+        if (!node) {
+            return 0;
+        }
+        node_t* out = extract_node(node);
+        destroy_node(out);
+
+        return 1;
+    }
+
+    template <typename K>
+        requires transparentComparator<Comp> && (!std::convertible_to<const K&, iterator>)
+    size_type erase(const K& key) {
+        node_t* node = find_node(header_.par, key);
         if (!node) {
             return 0;
         }
-        node_t* out = extract_node(node, par);
+        node_t* out = extract_node(node);
         destroy_node(out);
 
         return 1;
     }
 
+    // returns the value that followed pos. Only the in-order traversal keeps its order across an
+    // erase: in pre- and post-order unlinking pos (and rebalancing) moves other nodes around it, so
+    // the result is the old successor but the values after it are not necessarily the old rest;
+    // erase a range with erase(lhs, rhs) rather than a loop over this one
     iterator erase(iterator pos) {
-        node_t* out = extract_node(pos.node_, pos.node_->par);
+        iterator next = pos;
+        ++next;
+        node_t* out = extract_node(pos.node_);
         destroy_node(out);
 
-        return end();
+        return next;
     }
 
     void erase(iterator lhs, iterator rhs) {
-        while (lhs != rhs) {
-            iterator next = lhs;
-            ++next;
-            errase(lhs);
-            lhs = next;
+        if (lhs == begin() && rhs == end()) {
+            clear();
+            return;
+        }
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            while (lhs != rhs) {
+                lhs = erase(lhs);
+            }
+        }
+        else {
+            // the range is fixed before the first unlink reorders the traversal
+            std::vector<node_t*> nodes;
+            for (; lhs != rhs; ++lhs) {
+                nodes.push_back(lhs.node_);
+            }
+            for (node_t* node : nodes) {
+                destroy_node(extract_node(node));
+            }
+        }
+    }
+
+    node_type extract(const value_type& value) {
+        node_t* node = find_node(header_.par, value);
+        if (!node) {
+            return node_type();
         }
+
+        return node_type(extract_node(node), alloc_);
     }
 
-    node_t* extract(const value_type& value) {
-        auto [node, par] = smart_find(head_, nullptr, value);
-        return extract_node(node, par);
+    template <typename K>
+        requires transparentComparator<Comp> && (!std::convertible_to<const K&, iterator>)
+    node_type extract(const K& key) {
+        node_t* node = find_node(header_.par, key);
+        if (!node) {
+            return node_type();
+        }
+
+        return node_type(extract_node(node), alloc_);
     }
     
-    node_t* extract(iterator pos) {
-        return extract_node(pos.node_, pos.node_->par);
+    node_type extract(iterator pos) {
+        return node_type(extract_node(pos.node_), alloc_);
+    }
+
+    // relinks every node of source whose value is missing here, nothing is allocated or copied;
+    // both trees must use equal allocators
+    template <
+        traversalTag SourceTag,
+        typename SourceComp,
+        balanceTag SourceBalance
+    >
+    void merge(SearchTree<T, SourceTag, SourceComp, Allocator, SourceBalance, Augment>& source) {
+        assert(alloc_ == source.alloc_);
+        node_t* cur = source.find_left(source.header_.par, nullptr).first;
+        while (cur) {
+            node_t* next = source.in_order_next(cur);
+            auto [slot, par] = smart_find(header_.par, &header_, cur->value);
+            if (!slot) {
+                link_node(slot, par, source.extract_node(cur));
+            }
+            cur = next;
+        }
+    }
+
+    template <
+        traversalTag SourceTag,
+        typename SourceComp,
+        balanceTag SourceBalance
+    >
+    void merge(SearchTree<T, SourceTag, SourceComp, Allocator, SourceBalance, Augment>&& source) {
+        merge(source);
+    }
+
+    // moves the values before key into the first tree and the rest into the second, leaving this
+    // one empty. Nodes are relinked, not copied: O(log n) on balanced trees with order statistics,
+    // without them the smaller part is walked to find the sizes; threaded trees rebuild their thread.
+    // Scapegoat halves are walked once more and rebuilt if they ended up too deep for their size
+    std::pair<SearchTree, SearchTree> split(const value_type& key) {
+        auto [lhs, node, rhs] = split_subtree(take_root(), key);
+        // a node equal to key is the first of the right part
+        if (node) {
+            rhs = join_subtrees({ nullptr, 0 }, node, rhs);
+        }
+
+        SearchTree lhs_tree(comp_, alloc_);
+        SearchTree rhs_tree(comp_, alloc_);
+        if constexpr (instrumented) {
+            lhs_tree.counters_ = rhs_tree.counters_ = counters_;
+        }
+        lhs_tree.adopt(lhs);
+        rhs_tree.adopt(rhs);
+        if constexpr (order_statistics) {
+            lhs_tree.size_ = subtree_count(lhs.root);
+        }
+        else {
+            lhs_tree.size_ = lhs_tree.count_smaller_part(rhs_tree, size_);
+        }
+        rhs_tree.size_ = size_ - lhs_tree.size_;
+        size_ = 0;
+        reset_header(nullptr);
+        if constexpr (scapegoat) {
+            lhs_tree.scapegoat_settle();
+            rhs_tree.scapegoat_settle();
+        }
+
+        return { std::move(lhs_tree), std::move(rhs_tree) };
+    }
+
+    // every value of lhs must be ordered before every value of rhs and the allocators must be
+    // equal; O(log n) on rank balanced trees, linear on scapegoat ones, which check the depth of the
+    // result. It keeps the comparator and allocator of lhs
+    static SearchTree join(SearchTree lhs, SearchTree rhs) {
+        if (lhs.empty()) {
+            return rhs;
+        }
+        if (rhs.empty()) {
+            return lhs;
+        }
+        // rhs's nodes go back to lhs's allocator once erased
+        assert(lhs.alloc_ == rhs.alloc_);
+        // the smallest value of rhs becomes the node that links the two trees
+        node_t* node = rhs.extract_node(rhs.header_.lhs);
+        size_type size = lhs.size_ + rhs.size_ + 1;
+        subtree res = lhs.join_subtrees(lhs.take_root(), node, rhs.take_root());
+        lhs.adopt(res);
+        lhs.size_ = size;
+        rhs.size_ = 0;
+        rhs.reset_header(nullptr);
+        if constexpr (scapegoat) {
+            lhs.scapegoat_settle();
+        }
+
+        return lhs;
+    }
+
+    // Join-based set algebra: the root of rhs splits lhs, both halves are combined recursively, the
+    // larger ones forked onto pool, and the results are joined again. Both trees are consumed:
+    // nodes are relinked rather than copied, equal values are taken from lhs and the dropped nodes
+    // destroyed. O(m log(n / m + 1)) work for sizes m <= n; allocators must be equal
+    static SearchTree set_union(SearchTree lhs, SearchTree rhs, ThreadPool& pool = ThreadPool::shared())
+        requires rank_balanced {
+        return combine<set_operation::union_>(std::move(lhs), std::move(rhs), pool);
+    }
+
+    static SearchTree set_intersection(SearchTree lhs, SearchTree rhs, ThreadPool& pool = ThreadPool::shared())
+        requires rank_balanced {
+        return combine<set_operation::intersection>(std::move(lhs), std::move(rhs), pool);
+    }
+
+    // the values of lhs missing from rhs
+    static SearchTree set_difference(SearchTree lhs, SearchTree rhs, ThreadPool& pool = ThreadPool::shared())
+        requires rank_balanced {
+        return combine<set_operation::difference>(std::move(lhs), std::move(rhs), pool);
     }
 
     void clear() {
+        release_nodes();
         size_ = 0;
-        delete_tree(head_);
-        head_ = nullptr;
     }
 
 
     iterator find(const value_type& value) {
-        auto [node, par] = smart_find(head_, nullptr, value);
-        return iterator(node);
+        return make_iterator(or_end(find_node(header_.par, value)));
     }
 
     const_iterator find(const value_type& value) const {
-        auto [node, par] = smart_find(head_, nullptr, value);
-        return const_iterator(node);
+        return make_iterator(or_end(find_node(header_.par, value)));
     }
 
 
     iterator lower_bound(const value_type& value) {
-        return iterator(lower_bound(head_, value));
+        return make_iterator(or_end(lower_bound(header_.par, value)));
     }
 
     const_iterator lower_bound(const value_type& value) const {
-        return const_iterator(lower_bound(head_, value));
+        return make_iterator(or_end(lower_bound(header_.par, value)));
     }
 
     iterator upper_bound(const value_type& value) {
-        return iterator(upper_bound(head_, value));
+        return make_iterator(or_end(upper_bound(header_.par, value)));
     }
 
     const_iterator upper_bound(const value_type& value) const {
-        return const_iterator(upper_bound(head_, value));
+        return make_iterator(or_end(upper_bound(header_.par, value)));
     }
 
     std::pair<iterator, iterator> equal_range(const value_type& value) {
@@ -308,179 +735,1834 @@ public:
         return { lower_bound(value), upper_bound(value) };
     }
 
-public:
-    reverse_iterator rbegin() {
-        return std::reverse_iterator(end());
+    // heterogeneous lookup: the key is compared against stored values as is, no value_type is built
+    template <typename K>
+        requires transparentComparator<Comp>
+    iterator find(const K& key) {
+        return make_iterator(or_end(find_node(header_.par, key)));
     }
 
-    const_reverse_iterator crbegin() const {
-        return std::reverse_iterator(end());
+    template <typename K>
+        requires transparentComparator<Comp>
+    const_iterator find(const K& key) const {
+        return make_iterator(or_end(find_node(header_.par, key)));
     }
 
-    reverse_iterator rend() {
-        return std::reverse_iterator(begin());
+    template <typename K>
+        requires transparentComparator<Comp>
+    iterator lower_bound(const K& key) {
+        return make_iterator(or_end(lower_bound(header_.par, key)));
     }
 
-    const_reverse_iterator crend() const {
-        return std::reverse_iterator(begin());
+    template <typename K>
+        requires transparentComparator<Comp>
+    const_iterator lower_bound(const K& key) const {
+        return make_iterator(or_end(lower_bound(header_.par, key)));
     }
 
-public:
-    allocator_type get_allocator() const {
-        return alloc_;
+    template <typename K>
+        requires transparentComparator<Comp>
+    iterator upper_bound(const K& key) {
+        return make_iterator(or_end(upper_bound(header_.par, key)));
     }
 
-private:
-    std::pair<node_t*, node_t*> find_left(node_t* node, node_t* par) const {
-        if (!node) {
-            return { node, par };
-        }
-
-        while (node->lhs) {
-            par = node;
-            node = node->lhs;
-        }
-
-        return {node, par};
+    template <typename K>
+        requires transparentComparator<Comp>
+    const_iterator upper_bound(const K& key) const {
+        return make_iterator(or_end(upper_bound(header_.par, key)));
     }
 
-
-    std::pair<node_t*, node_t*> find_right(node_t* node, node_t* par) const {
-        if (!node) {
-            return { node, par };
-        }
-
-        while (node->rhs) {
-            par = node;
-            node = node->rhs;
-        }
-
-        return {node, par};
+    template <typename K>
+        requires transparentComparator<Comp>
+    std::pair<iterator, iterator> equal_range(const K& key) {
+        return { lower_bound(key), upper_bound(key) };
     }
 
-
-    node_t* create_node(const value_type& value, node_t* par) {
-        node_t* node = allocator_traits_type::allocate(alloc_, 1);
-        allocator_traits_type::construct(alloc_, node, value);
-        node->par = par;
-        return node;
+    template <typename K>
+        requires transparentComparator<Comp>
+    std::pair<const_iterator, const_iterator> equal_range(const K& key) const {
+        return { lower_bound(key), upper_bound(key) };
     }
 
+    // Batched lookups write one iterator per key to out, in input order. Up to
+    // batch_width queries walk down the tree in lockstep and each prefetches its next node, so
+    // the cache misses of different queries overlap instead of queueing one walk after another.
+    template <
+        std::forward_iterator key_iter_t,
+        typename out_iter_t
+    >
+    out_iter_t find_batch(key_iter_t lhs, key_iter_t rhs, out_iter_t out) const {
+        return walk_batch<true>(lhs, rhs, out);
+    }
 
-    void destroy_node(node_t* node) {
-        allocator_traits_type::destroy(alloc_, node);
-        allocator_traits_type::deallocate(alloc_, node, 1);
+    template <
+        std::forward_iterator key_iter_t,
+        typename out_iter_t
+    >
+    out_iter_t lower_bound_batch(key_iter_t lhs, key_iter_t rhs, out_iter_t out) const {
+        return walk_batch<false>(lhs, rhs, out);
     }
 
+public:
+    // k-th smallest value (from 0) whatever the traversal order, end() if k >= size()
+    const_iterator nth(size_type k) const
+        requires order_statistics {
+        return make_iterator(or_end(select(k)));
+    }
 
-    void copy(node_t* in, node_t*& out, node_t* out_par) {
-        if (!in) {
-            return;
-        }
-        out = create_node(in->value, out_par);
-        copy(in->lhs, out->lhs, out);
-        copy(in->rhs, out->rhs, out);
+    // number of values less than value
+    size_type rank(const value_type& value) const
+        requires order_statistics {
+        return rank_of(value);
     }
 
+    template <typename K>
+        requires order_statistics && transparentComparator<Comp>
+    size_type rank(const K& key) const {
+        return rank_of(key);
+    }
 
-    void delete_tree(node_t* node) {
-        if (!node) {
-            return;
-        }
-        if (node->lhs) {  
-            delete_tree(node->lhs);
-        }
-        if (node->rhs) {  
-            delete_tree(node->rhs);
+    // number of values in [lo, hi)
+    size_type count_range(const value_type& lo, const value_type& hi) const
+        requires order_statistics {
+        if (!comp_(lo, hi)) {
+            return 0;
         }
-        destroy_node(node);
+
+        return rank_of(hi) - rank_of(lo);
     }
 
+    // std::distance(first, last) in O(log n) for iterators of this tree
+    difference_type distance(const_iterator first, const_iterator last) const
+        requires order_statistics {
+        return difference_type(position(last.node_)) - difference_type(position(first.node_));
+    }
 
-    std::pair<node_t*&, node_t*> smart_find(node_t*& node, node_t* par, const value_type& value) const {
-        if (!node) {
-            return {node, par};
+public:
+    // Monoid::combine over the values in [lo, hi), in increasing order, for a range_aggregate<Monoid>
+    // tree: two paths down, each subtree wholly inside the range taken as a whole
+    auto aggregate(const value_type& lo, const value_type& hi) const
+        requires aggregateMonoid<aggregate_monoid, T> {
+        using aggregate_t = typename aggregate_monoid::value_type;
+        // the highest node in range splits it into a suffix of its left and a prefix of its right subtree
+        node_t* top = header_.par;
+        while (top) {
+            if (comp_(top->value, lo)) {
+                top = top->rhs;
+            }
+            else if (!comp_(top->value, hi)) {
+                top = top->lhs;
+            }
+            else {
+                break;
+            }
         }
-        if (node->value == value) {
-            return {node, par};
+        if (!top) {
+            return aggregate_t(aggregate_monoid::identity());
         }
 
-        if (comp_(value, node->value)) {
-            return smart_find(node->lhs, node, value);
-        }
-        else {
-            return smart_find(node->rhs, node, value);
-        }
+        aggregate_t lhs = aggregate_monoid::identity();
+        for (node_t* node = top->lhs; node;) {
+            if (comp_(node->value, lo)) {
+                node = node->rhs;
+                continue;
+            }
+            aggregate_t part = aggregate_monoid::lift(node->value);
+            if (node->rhs) {
+                part = aggregate_monoid::combine(part, node->rhs->aggregate);
+            }
+            lhs = aggregate_monoid::combine(part, lhs);
+            node = node->lhs;
+        }
+
+        aggregate_t rhs = aggregate_monoid::identity();
+        for (node_t* node = top->rhs; node;) {
+            if (!comp_(node->value, hi)) {
+                node = node->lhs;
+                continue;
+            }
+            aggregate_t part = aggregate_monoid::lift(node->value);
+            if (node->lhs) {
+                part = aggregate_monoid::combine(node->lhs->aggregate, part);
+            }
+            rhs = aggregate_monoid::combine(rhs, part);
+            node = node->rhs;
+        }
+
+        return aggregate_t(aggregate_monoid::combine(aggregate_monoid::combine(lhs, aggregate_monoid::lift(top->value)), rhs));
+    }
+
+    // over every value, in O(1)
+    auto aggregate() const
+        requires aggregateMonoid<aggregate_monoid, T> {
+        using aggregate_t = typename aggregate_monoid::value_type;
+
+        return header_.par ? aggregate_t(header_.par->aggregate) : aggregate_t(aggregate_monoid::identity());
+    }
+
+public:
+    reverse_iterator rbegin() {
+        return std::reverse_iterator(end());
+    }
+
+    const_reverse_iterator crbegin() const {
+        return std::reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return std::reverse_iterator(begin());
+    }
+
+    const_reverse_iterator crend() const {
+        return std::reverse_iterator(begin());
+    }
+
+public:
+    allocator_type get_allocator() const {
+        return allocator_type(alloc_);
+    }
+
+    // pointer-free read-only copy for lookup-heavy phases, later changes to the tree are not reflected
+    FrozenTree<T, Comp> freeze() const {
+        using in_order_iterator = TreeIterator<const T, in_order_tag, node_t, threaded && std::is_same_v<Tag, in_order_tag>>;
+        return FrozenTree<T, Comp>(sorted_unique, in_order_iterator(header_.lhs), in_order_iterator(end_node()), comp_);
+    }
+
+    // writes the frozen layout (see FrozenView::save), which MappedTree can search in place
+    void save(std::ostream& out) const
+        requires std::is_trivially_copyable_v<T> {
+        freeze().save(out);
+    }
+
+    // rebuilds a balanced tree (the saved shape is not kept) from what save() wrote in linear time;
+    // throws std::runtime_error on a malformed, unsorted or truncated stream
+    static SearchTree load(std::istream& in)
+        requires std::is_trivially_copyable_v<T> {
+        FrozenTree<T, Comp> frozen = FrozenTree<T, Comp>::load(in);
+
+        return SearchTree(sorted_unique, frozen.begin(), frozen.end());
+    }
+
+    // calls func on every value from the threads of pool, so func must be safe to run concurrently;
+    // the tree is split at subtree boundaries and no order between the calls is guaranteed
+    template <typename Func>
+    void parallel_for_each(Func func, ThreadPool& pool = ThreadPool::shared()) const {
+        if (header_.par) {
+            for_each_subtree(header_.par, func, pool, fork_levels(pool));
+        }
+    }
+
+    // folds transform(value) over the values in Tag order, as begin()..end() would; reduce must be
+    // associative and identity its neutral element, since subtrees are folded separately and the
+    // partial results combined in order
+    template <
+        typename U,
+        typename Reduce,
+        typename Transform = std::identity
+    >
+    U parallel_reduce(U identity, Reduce reduce, Transform transform = {}, ThreadPool& pool = ThreadPool::shared()) const {
+        if (!header_.par) {
+            return identity;
+        }
+
+        return reduce_subtree(header_.par, identity, reduce, transform, pool, fork_levels(pool));
+    }
+
+    // the values themselves folded on a pool of the caller's choice
+    template <
+        typename U,
+        typename Reduce
+    >
+    U parallel_reduce(U identity, Reduce reduce, ThreadPool& pool) const {
+        return parallel_reduce(std::move(identity), reduce, std::identity(), pool);
+    }
+
+public:
+    // counts since construction or the last reset_stats(); searches count their comparisons and
+    // nodes visited, and iterators handed out by this tree their steps. Both halves of a split()
+    // keep counting into the same block; iterators to values that join, merge or the set algebra
+    // move elsewhere count into the tree they came from, which must outlive them
+    TreeStats stats() const
+        requires instrumented {
+        return counters_ ? counters_->snapshot() : TreeStats();
+    }
+
+    void reset_stats()
+        requires instrumented {
+        if (counters_) {
+            counters_->reset();
+        }
+        else {
+            counters_ = make_counters();
+        }
+    }
+
+public:
+    // nodes on the longest path from the root, 0 for an empty tree; like the other shape
+    // diagnostics a walk over every node
+    size_type height() const {
+        return depth_histogram().size();
+    }
+
+    // res[d] is the number of nodes d links below the root
+    std::vector<size_type> depth_histogram() const {
+        std::vector<size_type> res;
+        walk_depths(header_.par, [&res](size_type depth) {
+            if (depth == res.size()) {
+                res.push_back(0);
+            }
+            ++res[depth];
+        });
+
+        return res;
+    }
+
+    // nodes a successful find() visits, averaged over the values in the tree
+    double average_path_length() const {
+        if (size_ == 0) {
+            return 0;
+        }
+        size_type total = 0;
+        walk_depths(header_.par, [&total](size_type depth) {
+            total += depth + 1;
+        });
+
+        return double(total) / size_;
+    }
+
+    // height() over that of a perfectly balanced tree of the same size: 1 is optimal, red-black
+    // trees stay within 2, sorted input into an unbalanced tree reaches about size() / log2(size())
+    double imbalance() const {
+        if (size_ == 0) {
+            return 1;
+        }
+
+        return double(height()) / std::bit_width(size_);
+    }
+
+private:
+    // an empty tree on the very same node allocator, not a copy rebound through allocator_type
+    SearchTree(const Comp& comp, const node_allocator_type& alloc)
+        : header_(), comp_(comp), alloc_(alloc), size_(0) {}
+
+
+    node_t* end_node() const {
+        return const_cast<node_t*>(&header_);
+    }
+
+
+    // O(1) for every Tag on balanced trees, see TreeIterator::first_leaf
+    node_t* first_node() const {
+        if constexpr (threaded) {
+            return header_.next;
+        }
+        else if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            return header_.lhs;
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            return or_end(header_.par);
+        }
+        else {
+            return header_.par ? internal_iterator::first_leaf(header_.lhs) : end_node();
+        }
+    }
+
+
+    node_t* or_end(node_t* node) const {
+        return node ? node : end_node();
+    }
+
+
+    iterator make_iterator(node_t* node) const {
+        if constexpr (instrumented) {
+            return iterator(node, counters_.get());
+        }
+        else {
+            return iterator(node);
+        }
+    }
+
+
+    // comp_ as the search loops call it, counted on instrumented trees
+    template <
+        typename lhs_t,
+        typename rhs_t
+    >
+    bool less(const lhs_t& lhs, const rhs_t& rhs) const {
+        count(&TreeCounters::comparisons);
+
+        return comp_(lhs, rhs);
+    }
+
+
+    void count_visit() const {
+        count(&TreeCounters::nodes_visited);
+    }
+
+
+    void count(std::atomic<std::uint64_t> TreeCounters::* counter, std::uint64_t n = 1) const {
+        if constexpr (instrumented) {
+            if (counters_) {
+                TreeCounters::add((*counters_).*counter, n);
+            }
+        }
+    }
+
+
+    static auto make_counters() {
+        if constexpr (instrumented) {
+            return std::make_shared<TreeCounters>();
+        }
+        else {
+            return unused<TreeCounters>();
+        }
+    }
+
+
+    // hangs root under the header and caches its leftmost and rightmost nodes
+    void reset_header(node_t* root) {
+        header_.par = root;
+        if (root) {
+            root->par = &header_;
+            header_.lhs = find_left(root, nullptr).first;
+            header_.rhs = find_right(root, nullptr).first;
+        }
+        else {
+            header_.lhs = header_.rhs = &header_;
+        }
+        if constexpr (threaded) {
+            thread_all();
+        }
+    }
+
+
+    // exchanges the nodes of two trees, end() iterators keep pointing at their own header
+    void swap_header(SearchTree& other) {
+        if constexpr (instrumented) {
+            counters_.swap(other.counters_);
+        }
+        if constexpr (scapegoat) {
+            std::swap(peak_size_, other.peak_size_);
+        }
+        std::swap(header_.par, other.header_.par);
+        std::swap(header_.lhs, other.header_.lhs);
+        std::swap(header_.rhs, other.header_.rhs);
+        if constexpr (threaded) {
+            std::swap(header_.next, other.header_.next);
+            std::swap(header_.prev, other.header_.prev);
+        }
+        for (node_t* header : { &header_, &other.header_ }) {
+            if (header->par) {
+                header->par->par = header;
+                if constexpr (threaded) {
+                    header->next->prev = header;
+                    header->prev->next = header;
+                }
+            }
+            else {
+                header->lhs = header->rhs = header;
+                if constexpr (threaded) {
+                    header->next = header->prev = header;
+                }
+            }
+        }
+    }
+
+
+    std::pair<node_t*, node_t*> find_left(node_t* node, node_t* par) const {
+        if (!node) {
+            return { node, par };
+        }
+
+        while (node->lhs) {
+            par = node;
+            node = node->lhs;
+        }
+
+        return {node, par};
+    }
+
+
+    // parent and side for linking value next to hint in O(1) amortized, {nullptr, false} if the hint is wrong
+    std::pair<node_t*, bool> hint_slot(node_t* hint, const value_type& value) const {
+        if (hint->header) {
+            if (!header_.par) {
+                return { nullptr, false };
+            }
+            node_t* last = header_.rhs;
+            if (comp_(last->value, value)) {
+                return { last, false };
+            }
+
+            return { nullptr, false };
+        }
+
+        if (comp_(value, hint->value)) {
+            node_t* prev = in_order_prev(hint);
+            if (prev && !comp_(prev->value, value)) {
+                return { nullptr, false };
+            }
+            if (!hint->lhs) {
+                return { hint, true };
+            }
+
+            return { prev, false };
+        }
+        if (comp_(hint->value, value)) {
+            node_t* next = in_order_next(hint);
+            if (next && !comp_(value, next->value)) {
+                return { nullptr, false };
+            }
+            if (!hint->rhs) {
+                return { hint, false };
+            }
+
+            return { next, true };
+        }
+
+        return { hint, false };
+    }
+
+
+    template <typename value_t>
+    std::pair<iterator, bool> insert_unique(value_t&& value) {
+        auto [slot, par] = smart_find(header_.par, &header_, value);
+        if (slot) {
+            return { make_iterator(slot), false };
+        }
+
+        return { make_iterator(link_node(slot, par, create_node(par, std::forward<value_t>(value)))), true };
+    }
+
+
+    template <typename value_t>
+    iterator insert_hint_unique(const_iterator hint, value_t&& value) {
+        auto [par, left] = hint_slot(hint.node_, value);
+        if (!par) {
+            return insert_unique(std::forward<value_t>(value)).first;
+        }
+        if (par == hint.node_ && !comp_(value, par->value) && !comp_(par->value, value)) {
+            return make_iterator(par);
+        }
+        node_t* node = create_node(par, std::forward<value_t>(value));
+
+        return make_iterator(link_node(left ? par->lhs : par->rhs, par, node));
+    }
+
+
+    // links a detached node using hint, or returns the equivalent node already in the tree
+    std::pair<node_t*, bool> insert_node(node_t* hint, node_t* node) {
+        auto [par, left] = hint_slot(hint, node->value);
+        if (par && !(par == hint && !comp_(node->value, par->value) && !comp_(par->value, node->value))) {
+            return { link_node(left ? par->lhs : par->rhs, par, node), true };
+        }
+        auto [slot, slot_par] = smart_find(header_.par, &header_, node->value);
+        if (slot) {
+            return { slot, false };
+        }
+
+        return { link_node(slot, slot_par, node), true };
+    }
+
+
+    node_t* link_node(node_t*& slot, node_t* par, node_t* node) {
+        slot = node;
+        node->par = par;
+        ++size_;
+        if (par == &header_) {
+            header_.lhs = header_.rhs = node;
+        }
+        else if (par == header_.lhs && &slot == &par->lhs) {
+            header_.lhs = node;
+        }
+        else if (par == header_.rhs && &slot == &par->rhs) {
+            header_.rhs = node;
+        }
+        if constexpr (order_statistics) {
+            node->count = 1;
+            for (; par != &header_; par = par->par) {
+                ++par->count;
+            }
+        }
+        if constexpr (aggregated) {
+            for (node_t* up = node; up != &header_; up = up->par) {
+                update_aggregate(up);
+            }
+        }
+        if constexpr (threaded) {
+            thread_leaf(node);
+        }
+        rebalance_after_insert(node);
+
+        return node;
+    }
+
+
+    static node_t* in_order_prev(node_t* node) {
+        if (node->lhs) {
+            node = node->lhs;
+            while (node->rhs) {
+                node = node->rhs;
+            }
+
+            return node;
+        }
+        while (!node->par->header && node == node->par->lhs) {
+            node = node->par;
+        }
+
+        return node->par->header ? nullptr : node->par;
+    }
+
+
+    static node_t* in_order_next(node_t* node) {
+        if (node->rhs) {
+            node = node->rhs;
+            while (node->lhs) {
+                node = node->lhs;
+            }
+
+            return node;
+        }
+        while (!node->par->header && node == node->par->rhs) {
+            node = node->par;
+        }
+
+        return node->par->header ? nullptr : node->par;
+    }
+
+
+    // depth of the last, incomplete level of a perfectly balanced tree of count nodes, the one
+    // build_balanced colours red
+    static int red_depth(size_type count) {
+        return std::bit_width(count + 1) - 1;
+    }
+
+
+    // links the next count nodes of an in-order sequence into a perfectly balanced subtree
+    template <typename node_source_t>
+    node_t* build_balanced(node_source_t& next_node, size_type count, node_t* par, int depth, int last_depth) {
+        if (count == 0) {
+            return nullptr;
+        }
+        size_type left = (count - 1) / 2;
+
+        node_t* lhs = build_balanced(next_node, left, nullptr, depth + 1, last_depth);
+        node_t* node = next_node();
+        node->par = par;
+        node->lhs = lhs;
+        if (lhs) {
+            lhs->par = node;
+        }
+        node->rhs = build_balanced(next_node, count - 1 - left, node, depth + 1, last_depth);
+
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            node->balance = depth == last_depth ? red : black;
+        }
+        else if constexpr (std::is_same_v<Balance, avl_tag>) {
+            update_height(node);
+        }
+        update_augments(node);
+
+        return node;
+    }
+
+
+    // detached subtree for split and join, black_height is only kept for red_black_tag
+    struct subtree {
+        node_t* root;
+        int black_height;
+    };
+
+
+    subtree take_root() {
+        node_t* root = header_.par;
+        header_.par = nullptr;
+        if (!root) {
+            return { nullptr, 0 };
+        }
+        root->par = nullptr;
+        int black_height = 0;
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            for (node_t* node = root; node; node = node->lhs) {
+                black_height += !is_red(node);
+            }
+        }
+
+        return { root, black_height };
+    }
+
+
+    // size_ is left to the caller
+    void adopt(subtree tree) {
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            if (tree.root) {
+                tree.root->balance = black;
+            }
+        }
+        reset_header(tree.root);
+    }
+
+
+    // links lhs, node and rhs, in this order, into one balanced subtree. The taller side is hung
+    // under the (unused) header and node goes down its inner spine to where the shorter side fits,
+    // so the usual insert fixups apply and the cost is the difference in heights
+    subtree join_subtrees(subtree lhs, node_t* node, subtree rhs) {
+        int black_height = 0;
+        bool left_taller = false;
+        bool right_taller = false;
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            for (subtree* side : { &lhs, &rhs }) {
+                if (is_red(side->root)) {
+                    side->root->balance = black;
+                    ++side->black_height;
+                }
+            }
+            left_taller = lhs.black_height > rhs.black_height;
+            right_taller = rhs.black_height > lhs.black_height;
+        }
+        else if constexpr (std::is_same_v<Balance, avl_tag>) {
+            left_taller = height(lhs.root) > height(rhs.root) + 1;
+            right_taller = height(rhs.root) > height(lhs.root) + 1;
+        }
+
+        if (!left_taller && !right_taller) {
+            node->lhs = lhs.root;
+            node->rhs = rhs.root;
+            node->par = nullptr;
+            for (node_t* child : { lhs.root, rhs.root }) {
+                if (child) {
+                    child->par = node;
+                }
+            }
+            if constexpr (std::is_same_v<Balance, red_black_tag>) {
+                node->balance = black;
+                black_height = lhs.black_height + 1;
+            }
+            else if constexpr (std::is_same_v<Balance, avl_tag>) {
+                update_height(node);
+            }
+            update_augments(node);
+
+            return { node, black_height };
+        }
+
+        subtree& tall = left_taller ? lhs : rhs;
+        subtree& small = left_taller ? rhs : lhs;
+        header_.par = tall.root;
+        tall.root->par = &header_;
+        node_t* par = &header_;
+        node_t* cur = tall.root;
+        int cur_height = tall.black_height;
+        while (true) {
+            if constexpr (std::is_same_v<Balance, red_black_tag>) {
+                if (!is_red(cur) && cur_height == small.black_height) {
+                    break;
+                }
+                cur_height -= !is_red(cur);
+            }
+            else if (height(cur) <= height(small.root) + 1) {
+                break;
+            }
+            par = cur;
+            cur = left_taller ? cur->rhs : cur->lhs;
+        }
+
+        node->lhs = left_taller ? cur : small.root;
+        node->rhs = left_taller ? small.root : cur;
+        for (node_t* child : { node->lhs, node->rhs }) {
+            if (child) {
+                child->par = node;
+            }
+        }
+        node->par = par;
+        if (par == &header_) {
+            header_.par = node;
+        }
+        else if (left_taller) {
+            par->rhs = node;
+        }
+        else {
+            par->lhs = node;
+        }
+        if constexpr (order_statistics || aggregated) {
+            for (node_t* up = node; up != &header_; up = up->par) {
+                update_augments(up);
+            }
+        }
+
+        black_height = tall.black_height;
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            node->balance = red;
+            black_height += red_black_insert_fixup(node);
+        }
+        else if constexpr (std::is_same_v<Balance, avl_tag>) {
+            avl_retrace(node);
+        }
+
+        node_t* root = header_.par;
+        header_.par = nullptr;
+        root->par = nullptr;
+
+        return { root, black_height };
+    }
+
+
+    struct split_result {
+        subtree lhs;
+        // the node equal to key, if any, linked to neither side
+        node_t* node;
+        subtree rhs;
+    };
+
+
+    // joins the parts left and right of the search path for key bottom-up
+    split_result split_subtree(subtree tree, const value_type& key) {
+        // the search path, each node with the black height of its subtree
+        std::vector<std::pair<node_t*, int>> path;
+        node_t* node = tree.root;
+        int node_height = tree.black_height;
+        while (node && !(!comp_(node->value, key) && !comp_(key, node->value))) {
+            path.emplace_back(node, node_height);
+            node_height -= !is_red(node);
+            node = comp_(node->value, key) ? node->rhs : node->lhs;
+        }
+
+        subtree lhs = { nullptr, 0 };
+        subtree rhs = { nullptr, 0 };
+        if (node) {
+            int child_height = node_height - !is_red(node);
+            lhs = { node->lhs, child_height };
+            rhs = { node->rhs, child_height };
+            node->par = node->lhs = node->rhs = nullptr;
+        }
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            auto [cur, cur_height] = *it;
+            int child_height = cur_height - !is_red(cur);
+            if (comp_(cur->value, key)) {
+                lhs = join_subtrees({ cur->lhs, child_height }, cur, lhs);
+            }
+            else {
+                rhs = join_subtrees(rhs, cur, { cur->rhs, child_height });
+            }
+        }
+
+        return { lhs, node, rhs };
+    }
+
+
+    // join_subtrees without a middle node, the last node of lhs takes that place
+    subtree join_pieces(subtree lhs, subtree rhs) {
+        if (!lhs.root) {
+            return rhs;
+        }
+        if (!rhs.root) {
+            return lhs;
+        }
+        node_t* last = find_right(lhs.root, nullptr).first;
+        split_result parts = split_subtree(lhs, last->value);
+
+        return join_subtrees(parts.lhs, parts.node, rhs);
+    }
+
+
+    enum class set_operation {
+        union_,
+        intersection,
+        difference
+    };
+
+    // rotations of pre- and post-order threaded trees relink the thread around the rotated nodes,
+    // which may belong to another task's subtree, so the recursion runs on in-order scratch trees
+    using scratch_tree = SearchTree<T, in_order_tag, Comp, Allocator, Balance, Augment>;
+
+
+    template <set_operation Op>
+    static SearchTree combine(SearchTree lhs, SearchTree rhs, ThreadPool& pool) {
+        // dropped and relinked nodes of rhs all end up with lhs's allocator
+        assert(lhs.empty() || rhs.empty() || lhs.alloc_ == rhs.alloc_);
+        size_type size = lhs.size_ + rhs.size_;
+        scratch_tree scratch(lhs.get_allocator());
+        scratch.comp_ = lhs.comp_;
+        int forks = fork_levels(pool);
+
+        std::vector<node_t*> dropped;
+        subtree lhs_root = lhs.take_root();
+        subtree rhs_root = rhs.take_root();
+        auto res = scratch.template combine_subtrees<static_cast<typename scratch_tree::set_operation>(Op)>(
+            { lhs_root.root, lhs_root.black_height }, { rhs_root.root, rhs_root.black_height }, dropped, pool, forks);
+
+        // allocators are not shared between threads, so nodes are only destroyed here
+        for (node_t* node : dropped) {
+            lhs.destroy_node(node);
+        }
+        lhs.adopt({ res.root, res.black_height });
+        lhs.size_ = size - dropped.size();
+        rhs.size_ = 0;
+        rhs.reset_header(nullptr);
+
+        return lhs;
+    }
+
+
+    // called on a scratch tree, whose header serves the fixups of the joins
+    template <set_operation Op>
+    subtree combine_subtrees(subtree lhs, subtree rhs, std::vector<node_t*>& dropped, ThreadPool& pool, int forks) {
+        if (!lhs.root || !rhs.root) {
+            if constexpr (Op == set_operation::union_) {
+                return lhs.root ? lhs : rhs;
+            }
+            else if constexpr (Op == set_operation::intersection) {
+                collect_nodes(lhs.root ? lhs.root : rhs.root, dropped);
+                return { nullptr, 0 };
+            }
+            else {
+                collect_nodes(rhs.root, dropped);
+                return lhs;
+            }
+        }
+
+        node_t* pivot = rhs.root;
+        int child_height = rhs.black_height - !is_red(pivot);
+        subtree pivot_lhs = { pivot->lhs, child_height };
+        subtree pivot_rhs = { pivot->rhs, child_height };
+        split_result parts = split_subtree(lhs, pivot->value);
+
+        subtree res_lhs;
+        subtree res_rhs;
+        if (forks > 0 && worth_forking(rhs)) {
+            std::vector<node_t*> dropped_rhs;
+            pool.fork_join(
+                [&]() {
+                    res_lhs = combine_subtrees<Op>(parts.lhs, pivot_lhs, dropped, pool, forks - 1);
+                },
+                [&]() {
+                    SearchTree scratch(get_allocator());
+                    scratch.comp_ = comp_;
+                    res_rhs = scratch.template combine_subtrees<Op>(parts.rhs, pivot_rhs, dropped_rhs, pool, forks - 1);
+                });
+            dropped.insert(dropped.end(), dropped_rhs.begin(), dropped_rhs.end());
+        }
+        else {
+            res_lhs = combine_subtrees<Op>(parts.lhs, pivot_lhs, dropped, pool, 0);
+            res_rhs = combine_subtrees<Op>(parts.rhs, pivot_rhs, dropped, pool, 0);
+        }
+
+        if constexpr (Op == set_operation::union_) {
+            if (!parts.node) {
+                return join_subtrees(res_lhs, pivot, res_rhs);
+            }
+            dropped.push_back(pivot);
+
+            return join_subtrees(res_lhs, parts.node, res_rhs);
+        }
+        dropped.push_back(pivot);
+        if (parts.node && Op == set_operation::intersection) {
+            return join_subtrees(res_lhs, parts.node, res_rhs);
+        }
+        if (parts.node) {
+            dropped.push_back(parts.node);
+        }
+
+        return join_pieces(res_lhs, res_rhs);
+    }
+
+
+    // a fork pays off from a few hundred nodes on
+    static bool worth_forking(subtree tree) {
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            return tree.black_height >= 5;
+        }
+        else {
+            return height(tree.root) >= 9;
+        }
+    }
+
+
+    static void collect_nodes(node_t* root, std::vector<node_t*>& out) {
+        if (!root) {
+            return;
+        }
+        std::size_t pos = out.size();
+        out.push_back(root);
+        for (; pos < out.size(); ++pos) {
+            for (node_t* child : { out[pos]->lhs, out[pos]->rhs }) {
+                if (child) {
+                    out.push_back(child);
+                }
+            }
+        }
+    }
+
+
+    // forking a few levels deeper than the pool is wide leaves room for stealing
+    static int fork_levels(const ThreadPool& pool) {
+        return std::bit_width(pool.size()) + 2;
+    }
+
+
+    // a subtree is one contiguous run in every traversal order, these are its ends
+    static std::pair<node_t*, node_t*> subtree_range(node_t* node) {
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            node_t* first = node;
+            node_t* last = node;
+            while (first->lhs) {
+                first = first->lhs;
+            }
+            while (last->rhs) {
+                last = last->rhs;
+            }
+
+            return { first, last };
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            return { node, internal_iterator::last_leaf(node) };
+        }
+        else {
+            return { internal_iterator::first_leaf(node), node };
+        }
+    }
+
+
+    template <typename Func>
+    static void visit_subtree(node_t* node, Func&& func) {
+        auto [first, last] = subtree_range(node);
+        for (const_iterator it(first);; ++it) {
+            func(*it);
+            if (it.node_ == last) {
+                break;
+            }
+        }
+    }
+
+
+    // subtrees missing a child are not worth splitting further
+    template <typename Func>
+    void for_each_subtree(node_t* node, Func& func, ThreadPool& pool, int forks) const {
+        if (forks == 0 || !node->lhs || !node->rhs) {
+            visit_subtree(node, func);
+            return;
+        }
+        pool.fork_join(
+            [&]() {
+                for_each_subtree(node->lhs, func, pool, forks - 1);
+            },
+            [&]() {
+                for_each_subtree(node->rhs, func, pool, forks - 1);
+            });
+        func(std::as_const(node->value));
+    }
+
+
+    template <
+        typename U,
+        typename Reduce,
+        typename Transform
+    >
+    U reduce_subtree(node_t* node, const U& identity, Reduce& reduce, Transform& transform, ThreadPool& pool, int forks) const {
+        if (forks == 0 || !node->lhs || !node->rhs) {
+            U res = identity;
+            visit_subtree(node, [&](const value_type& value) {
+                res = reduce(std::move(res), transform(value));
+            });
+
+            return res;
+        }
+
+        U lhs = identity;
+        U rhs = identity;
+        pool.fork_join(
+            [&]() {
+                lhs = reduce_subtree(node->lhs, identity, reduce, transform, pool, forks - 1);
+            },
+            [&]() {
+                rhs = reduce_subtree(node->rhs, identity, reduce, transform, pool, forks - 1);
+            });
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            return reduce(reduce(std::move(lhs), transform(std::as_const(node->value))), std::move(rhs));
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            return reduce(reduce(reduce(identity, transform(std::as_const(node->value))), std::move(lhs)), std::move(rhs));
+        }
+        else {
+            return reduce(reduce(std::move(lhs), std::move(rhs)), transform(std::as_const(node->value)));
+        }
+    }
+
+
+    // size of this tree, freshly split off other, walking both from their outer ends at once
+    size_type count_smaller_part(const SearchTree& other, size_type total) const {
+        node_t* cur = header_.par ? header_.lhs : nullptr;
+        node_t* other_cur = other.header_.par ? other.header_.rhs : nullptr;
+        size_type count = 0;
+        while (cur && other_cur) {
+            cur = in_order_next(cur);
+            other_cur = in_order_prev(other_cur);
+            ++count;
+        }
+        if (!cur) {
+            return count;
+        }
+
+        return total - count;
+    }
+
+
+    // Perfect subtrees are built as values arrive, like the digits of a binary counter: a new leaf
+    // merges with the pending subtrees of its height through the value read before it. Only the
+    // O(log n) pending pieces are held, and they are joined into one balanced tree at the end
+    template <typename input_iter_t>
+    void build_streaming(input_iter_t lhs, input_iter_t rhs) {
+        // heights strictly decrease up the stack, only the top may still wait for its root,
+        // the value that follows it and links it to the next subtree
+        struct pending_tree {
+            node_t* tree;
+            int height;
+            node_t* root;
+        };
+        std::vector<pending_tree> pending;
+        // one piece per bit of the count, so pushing never reallocates
+        pending.reserve(std::numeric_limits<size_type>::digits);
+        size_type count = 0;
+
+        try {
+            for (; lhs != rhs; ++lhs, ++count) {
+                node_t* node = create_node(nullptr, *lhs);
+                if (!pending.empty() && !pending.back().root) {
+                    pending.back().root = node;
+                    continue;
+                }
+
+                node_t* tree = link_perfect(node, nullptr, nullptr, 1);
+                int height = 1;
+                while (!pending.empty() && pending.back().height == height) {
+                    ++height;
+                    tree = link_perfect(pending.back().root, pending.back().tree, tree, height);
+                    pending.pop_back();
+                }
+                pending.push_back({ tree, height, nullptr });
+            }
+        }
+        catch (...) {
+            for (const pending_tree& piece : pending) {
+                delete_tree(piece.tree);
+                if (piece.root) {
+                    destroy_node(piece.root);
+                }
+            }
+            throw;
+        }
+
+        // perfect trees are all black, their black height is their height
+        subtree res = { nullptr, 0 };
+        for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
+            if (it->root) {
+                res = join_subtrees({ it->tree, it->height }, it->root, res);
+            }
+            else {
+                res = { it->tree, it->height };
+            }
+        }
+        adopt(res);
+        size_ = count;
+    }
+
+
+    // node over two perfect subtrees of height - 1
+    node_t* link_perfect(node_t* node, node_t* lhs, node_t* rhs, int height) {
+        node->par = nullptr;
+        node->lhs = lhs;
+        node->rhs = rhs;
+        for (node_t* child : { lhs, rhs }) {
+            if (child) {
+                child->par = node;
+            }
+        }
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            node->balance = black;
+        }
+        else if constexpr (std::is_same_v<Balance, avl_tag>) {
+            node->balance = std::int8_t(height);
+        }
+        update_augments(node);
+
+        return node;
+    }
+
+
+    std::pair<node_t*, node_t*> find_right(node_t* node, node_t* par) const {
+        if (!node) {
+            return { node, par };
+        }
+
+        while (node->rhs) {
+            par = node;
+            node = node->rhs;
+        }
+
+        return {node, par};
+    }
+
+
+    template <typename... Args>
+    node_t* create_node(node_t* par, Args&&... args) {
+        node_t* node = allocator_traits_type::allocate(alloc_, 1);
+        try {
+            allocator_traits_type::construct(alloc_, node, std::in_place, std::forward<Args>(args)...);
+        }
+        catch (...) {
+            allocator_traits_type::deallocate(alloc_, node, 1);
+            throw;
+        }
+        count(&TreeCounters::allocations);
+        node->par = par;
+        return node;
+    }
+
+
+    void destroy_node(node_t* node, bool deallocate = true) {
+        allocator_traits_type::destroy(alloc_, node);
+        if (deallocate) {
+            allocator_traits_type::deallocate(alloc_, node, 1);
+            count(&TreeCounters::deallocations);
+        }
+    }
+
+
+    // pre-order walk that climbs back through par links, so no stack is used
+    void copy(const node_t* in, node_t*& out, node_t* out_par) {
+        if (!in) {
+            return;
+        }
+        out = clone_node(in, out_par);
+
+        try {
+            const node_t* src = in;
+            node_t* dst = out;
+            while (true) {
+                if (src->lhs && !dst->lhs) {
+                    dst->lhs = clone_node(src->lhs, dst);
+                    src = src->lhs;
+                    dst = dst->lhs;
+                }
+                else if (src->rhs && !dst->rhs) {
+                    dst->rhs = clone_node(src->rhs, dst);
+                    src = src->rhs;
+                    dst = dst->rhs;
+                }
+                else if (src == in) {
+                    break;
+                }
+                else {
+                    src = src->par;
+                    dst = dst->par;
+                }
+            }
+        }
+        catch (...) {
+            delete_tree(out);
+            out = nullptr;
+            throw;
+        }
+    }
+
+
+    node_t* clone_node(const node_t* in, node_t* par) {
+        node_t* out = create_node(par, in->value);
+        out->balance = in->balance;
+        if constexpr (order_statistics) {
+            out->count = in->count;
+        }
+        if constexpr (aggregated) {
+            out->aggregate = in->aggregate;
+        }
+
+        return out;
+    }
+
+
+    // post-order teardown over par links, detaching each leaf before it is freed
+    void delete_tree(node_t* node, bool deallocate = true) {
+        if (!node) {
+            return;
+        }
+        node_t* stop = node->par;
+
+        while (node != stop) {
+            if (node->lhs) {
+                node = node->lhs;
+            }
+            else if (node->rhs) {
+                node = node->rhs;
+            }
+            else {
+                node_t* par = node->par;
+                if (par != stop) {
+                    if (par->lhs == node) {
+                        par->lhs = nullptr;
+                    }
+                    else {
+                        par->rhs = nullptr;
+                    }
+                }
+                destroy_node(node, deallocate);
+                node = par;
+            }
+        }
+    }
+
+
+    // a pool owned by this tree alone is dropped chunk by chunk instead of node by node; counted
+    // as size_ deallocations all the same
+    void release_nodes() {
+        if constexpr (bulkReleasable<node_allocator_type>) {
+            if (alloc_.exclusive()) {
+                if constexpr (!std::is_trivially_destructible_v<node_t>) {
+                    delete_tree(header_.par, false);
+                }
+                count(&TreeCounters::deallocations, size_);
+                alloc_.release();
+                reset_header(nullptr);
+                return;
+            }
+        }
+        delete_tree(header_.par);
+        reset_header(nullptr);
+    }
+
+
+    // returns the slot holding value (or where it would be linked) and the slot's parent
+    std::pair<node_t*&, node_t*> smart_find(node_t*& node, node_t* par, const value_type& value) const {
+        node_t** slot = &node;
+
+        while (*slot) {
+            count_visit();
+            if (less(value, (*slot)->value)) {
+                par = *slot;
+                slot = &par->lhs;
+            }
+            else if (less((*slot)->value, value)) {
+                par = *slot;
+                slot = &par->rhs;
+            }
+            else {
+                break;
+            }
+        }
+
+        return {*slot, par};
+    }
+
+
+    template <typename K>
+    node_t* find_node(node_t* node, const K& value) const {
+        while (node) {
+            count_visit();
+            if (less(value, node->value)) {
+                node = node->lhs;
+            }
+            else if (less(node->value, value)) {
+                node = node->rhs;
+            }
+            else {
+                break;
+            }
+        }
+
+        return node;
     }
 
 
-    node_t* extract_node(node_t* node, node_t* par) {
+    node_t* extract_node(node_t* node) {
         if (!node) {
             return nullptr;
         }
         --size_;
+        if (node == header_.lhs) {
+            header_.lhs = or_end(in_order_next(node));
+        }
+        if (node == header_.rhs) {
+            header_.rhs = or_end(in_order_prev(node));
+        }
 
-        node_t* out = node;
+        // child takes the vacated slot under child_par, removed_balance is the colour that left the tree
+        node_t* child;
+        node_t* child_par;
+        std::int8_t removed_balance = node->balance;
 
-        if (!node->lhs) {
-            if (!node->rhs) {
-                node = nullptr; 
-                if (!par) {
-                    head_ = nullptr; 
-                }
+        if (!node->lhs || !node->rhs) {
+            if constexpr (threaded) {
+                unthread(node);
+            }
+            child = node->lhs ? node->lhs : node->rhs;
+            child_par = node->par;
+            replace_child(node->par, node, child);
+            if (child) {
+                child->par = child_par;
+            }
+        }
+        else {
+            auto [prev, prev_par] = find_right(node->lhs, node);
+            // prev leaves its place and takes node's in every traversal order
+            if constexpr (threaded) {
+                unthread(prev);
+                unthread(node, prev);
+            }
+            removed_balance = prev->balance;
+            child = prev->lhs;
+
+            if (prev_par == node) {
+                child_par = prev;
             }
             else {
-                node = node->rhs;
-                node->par = par;   
-                if (!par) {
-                    head_ = node; 
+                child_par = prev_par;
+                prev_par->rhs = child;
+                if (child) {
+                    child->par = prev_par;
                 }
+                prev->lhs = node->lhs;
+                prev->lhs->par = prev;
+            }
+
+            prev->rhs = node->rhs;
+            prev->rhs->par = prev;
+            prev->par = node->par;
+            prev->balance = node->balance;
+            if constexpr (order_statistics) {
+                prev->count = node->count;
             }
+            replace_child(node->par, node, prev);
         }
-        else if (!node->rhs) {
-            node = node->lhs;  
-            node->par = par;  
-            if (!par) {
-                head_ = node;  
+        node->par = node->lhs = node->rhs = nullptr;
+        if constexpr (order_statistics) {
+            for (node_t* cur = child_par; cur != &header_; cur = cur->par) {
+                --cur->count;
             }
         }
+        // prev, if it moved, is on the way up
+        if constexpr (aggregated) {
+            for (node_t* cur = child_par; cur != &header_; cur = cur->par) {
+                update_aggregate(cur);
+            }
+        }
+
+        rebalance_after_erase(child, child_par, removed_balance);
+
+        return node; 
+    }
+
+
+    void replace_child(node_t* par, node_t* old_child, node_t* new_child) {
+        if (par == &header_) {
+            header_.par = new_child;
+        }
+        else if (par->lhs == old_child) {
+            par->lhs = new_child;
+        }
         else {
-            auto [prev, prev_par] = find_right(node->lhs, node);
+            par->rhs = new_child;
+        }
+    }
 
-            if (prev_par->lhs == prev) {
-                prev_par->lhs = prev->lhs; 
+
+    node_t* rotate_left(node_t* node) {
+        node_t* top = node->rhs;
+        if constexpr (threaded && !std::is_same_v<Tag, in_order_tag>) {
+            // node(a, top(b, c)) becomes top(node(a, b), c)
+            node_t* a = node->lhs;
+            node_t* b = top->lhs;
+            node_t* c = top->rhs;
+            if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                rethread({ node, a, top, b, c }, { top, node, a, b, c });
             }
             else {
-                prev_par->rhs = prev->lhs; 
+                rethread({ node, top, c, b, a }, { top, c, node, b, a });
             }
+        }
 
-            prev->lhs = node->lhs;
-            prev->rhs = node->rhs;
+        node->rhs = top->lhs;
+        if (top->lhs) {
+            top->lhs->par = node;
+        }
+        top->par = node->par;
+        replace_child(node->par, node, top);
+        top->lhs = node;
+        node->par = top;
+
+        if constexpr (std::is_same_v<Balance, avl_tag>) {
+            update_height(node);
+            update_height(top);
+        }
+        update_augments(node);
+        update_augments(top);
+
+        return top;
+    }
+
+
+    node_t* rotate_right(node_t* node) {
+        node_t* top = node->lhs;
+        if constexpr (threaded && !std::is_same_v<Tag, in_order_tag>) {
+            // node(top(a, b), c) becomes top(a, node(b, c))
+            node_t* a = top->lhs;
+            node_t* b = top->rhs;
+            node_t* c = node->rhs;
+            if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                rethread({ node, top, a, b, c }, { top, a, node, b, c });
+            }
+            else {
+                rethread({ node, c, top, b, a }, { top, node, c, b, a });
+            }
+        }
+
+        node->lhs = top->rhs;
+        if (top->rhs) {
+            top->rhs->par = node;
+        }
+        top->par = node->par;
+        replace_child(node->par, node, top);
+        top->rhs = node;
+        node->par = top;
+
+        if constexpr (std::is_same_v<Balance, avl_tag>) {
+            update_height(node);
+            update_height(top);
+        }
+        update_augments(node);
+        update_augments(top);
+
+        return top;
+    }
+
+
+    void rebalance_after_insert(node_t* node) {
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            node->balance = red;
+            red_black_insert_fixup(node);
+        }
+        else if constexpr (std::is_same_v<Balance, avl_tag>) {
+            node->balance = 1;
+            avl_retrace(node->par);
+        }
+        else if constexpr (scapegoat) {
+            scapegoat_insert(node);
+        }
+    }
+
+
+    void rebalance_after_erase(node_t* child, node_t* child_par, std::int8_t removed_balance) {
+        if constexpr (std::is_same_v<Balance, red_black_tag>) {
+            if (removed_balance == black) {
+                red_black_erase_fixup(child, child_par);
+            }
+        }
+        else if constexpr (std::is_same_v<Balance, avl_tag>) {
+            avl_retrace(child_par);
+        }
+        else if constexpr (scapegoat) {
+            if (size_ * 2 < peak_size_) {
+                if (header_.par) {
+                    rebuild(header_.par, size_);
+                }
+                peak_size_ = size_;
+            }
+        }
+    }
+
+
+    // deepest a node may sit, in links below the root, in a scapegoat tree of count nodes
+    static double depth_limit(size_type count) {
+        return Balance::depth_factor * std::log2(double(count));
+    }
 
-            if (prev->rhs) {
-                prev->rhs->par = prev; 
+
+    // after split or join the shape is unchanged but the size is not: a tree now deeper than its
+    // size allows is rebuilt, and shrinking is measured from here on
+    void scapegoat_settle() {
+        if (header_.par && double(height() - 1) > depth_limit(size_)) {
+            rebuild(header_.par, size_);
+        }
+        peak_size_ = size_;
+    }
+
+
+    // a node linked too deep is the first to notice: going up from it, the lowest ancestor whose
+    // subtree is too tall for its own size is rebuilt, the root at the latest
+    void scapegoat_insert(node_t* node) {
+        peak_size_ = std::max(peak_size_, size_);
+        size_type depth = 0;
+        for (node_t* cur = node; cur->par != &header_; cur = cur->par) {
+            ++depth;
+        }
+        if (double(depth) <= depth_limit(size_)) {
+            return;
+        }
+
+        size_type count = 1;
+        size_type below = 0;
+        for (node_t* cur = node; ; cur = cur->par) {
+            node_t* par = cur->par;
+            ++below;
+            count += 1 + subtree_size(par->lhs == cur ? par->rhs : par->lhs);
+            if (double(below) > depth_limit(count) || par->par == &header_) {
+                rebuild(par, count);
+                return;
+            }
+        }
+    }
+
+
+    // relinks the count nodes under node into a perfectly balanced subtree in the same place; the
+    // subtree is contiguous in every traversal order, so only its own part of a thread is redone
+    void rebuild(node_t* node, size_type count) {
+        node_t* par = node->par;
+        [[maybe_unused]] node_t* outer_prev = nullptr;
+        [[maybe_unused]] node_t* outer_next = nullptr;
+        if constexpr (threaded && std::is_same_v<Tag, pre_order_tag>) {
+            outer_prev = node->prev;
+            outer_next = internal_iterator::last_leaf(node)->next;
+        }
+        else if constexpr (threaded && std::is_same_v<Tag, post_order_tag>) {
+            outer_prev = internal_iterator::first_leaf(node)->prev;
+            outer_next = node->next;
+        }
+
+        std::vector<node_t*> nodes;
+        nodes.reserve(count);
+        for (node_t* cur = find_left(node, nullptr).first; ; cur = in_order_next(cur)) {
+            nodes.push_back(cur);
+            if (nodes.size() == count) {
+                break;
+            }
+        }
+        auto next_node = [&nodes, pos = size_type(0)]() mutable {
+            return nodes[pos++];
+        };
+        node_t* root = build_balanced(next_node, count, par, 0, red_depth(count));
+        replace_child(par, node, root);
+
+        if constexpr (threaded && !std::is_same_v<Tag, in_order_tag>) {
+            using structural_iterator = TreeIterator<T, Tag, node_t, false>;
+            structural_iterator cur(std::is_same_v<Tag, pre_order_tag> ? root : internal_iterator::first_leaf(root));
+            node_t* prev = outer_prev;
+            for (size_type i = 0; i < count; ++i, ++cur) {
+                link_thread(prev, cur.node_);
+                prev = cur.node_;
+            }
+            link_thread(prev, outer_next);
+        }
+    }
+
+
+    size_type subtree_size(const node_t* node) const {
+        if constexpr (order_statistics) {
+            return subtree_count(node);
+        }
+        size_type res = 0;
+        walk_depths(node, [&res](size_type) {
+            ++res;
+        });
+
+        return res;
+    }
+
+
+    // calls func with the depth below root of every node in root's subtree, pre-order over the
+    // par links, so no stack is used
+    template <typename Func>
+    static void walk_depths(const node_t* root, Func func) {
+        if (!root) {
+            return;
+        }
+        const node_t* stop = root->par;
+        const node_t* prev = stop;
+        const node_t* cur = root;
+        size_type depth = 0;
+        while (cur != stop) {
+            const node_t* next;
+            if (prev == cur->par) {
+                func(depth);
+                next = cur->lhs ? cur->lhs : cur->rhs ? cur->rhs : cur->par;
             }
-            if (prev->lhs) {
-                prev->lhs->par = prev;  
+            else if (prev == cur->lhs && cur->rhs) {
+                next = cur->rhs;
             }
+            else {
+                next = cur->par;
+            }
+            if (next == cur->par) {
+                --depth;
+            }
+            else {
+                ++depth;
+            }
+            prev = cur;
+            cur = next;
+        }
+    }
+
+
+    static bool is_red(const node_t* node) {
+        return node && node->balance == red;
+    }
+
+
+    // returns whether the root had to be turned black, which adds a level of black height
+    bool red_black_insert_fixup(node_t* node) {
+        while (is_red(node->par)) {
+            node_t* par = node->par;
+            node_t* grand = par->par;
+
+            if (par == grand->lhs) {
+                node_t* uncle = grand->rhs;
+                if (is_red(uncle)) {
+                    par->balance = black;
+                    uncle->balance = black;
+                    grand->balance = red;
+                    node = grand;
+                }
+                else {
+                    if (node == par->rhs) {
+                        node = par;
+                        rotate_left(node);
+                        par = node->par;
+                    }
+                    par->balance = black;
+                    grand->balance = red;
+                    rotate_right(grand);
+                }
+            }
+            else {
+                node_t* uncle = grand->lhs;
+                if (is_red(uncle)) {
+                    par->balance = black;
+                    uncle->balance = black;
+                    grand->balance = red;
+                    node = grand;
+                }
+                else {
+                    if (node == par->lhs) {
+                        node = par;
+                        rotate_right(node);
+                        par = node->par;
+                    }
+                    par->balance = black;
+                    grand->balance = red;
+                    rotate_left(grand);
+                }
+            }
+        }
+        bool grew = is_red(header_.par);
+        header_.par->balance = black;
+
+        return grew;
+    }
+
 
-            node = prev;
-            prev->par = par;  
-            if (!par) {
-                head_ = node;  
+    void red_black_erase_fixup(node_t* node, node_t* par) {
+        while (par != &header_ && !is_red(node)) {
+            if (node == par->lhs) {
+                node_t* sibling = par->rhs;
+                if (is_red(sibling)) {
+                    sibling->balance = black;
+                    par->balance = red;
+                    rotate_left(par);
+                    sibling = par->rhs;
+                }
+                if (!is_red(sibling->lhs) && !is_red(sibling->rhs)) {
+                    sibling->balance = red;
+                    node = par;
+                    par = node->par;
+                }
+                else {
+                    if (!is_red(sibling->rhs)) {
+                        sibling->lhs->balance = black;
+                        sibling->balance = red;
+                        rotate_right(sibling);
+                        sibling = par->rhs;
+                    }
+                    sibling->balance = par->balance;
+                    par->balance = black;
+                    sibling->rhs->balance = black;
+                    rotate_left(par);
+                    node = header_.par;
+                    par = &header_;
+                }
+            }
+            else {
+                node_t* sibling = par->lhs;
+                if (is_red(sibling)) {
+                    sibling->balance = black;
+                    par->balance = red;
+                    rotate_right(par);
+                    sibling = par->lhs;
+                }
+                if (!is_red(sibling->lhs) && !is_red(sibling->rhs)) {
+                    sibling->balance = red;
+                    node = par;
+                    par = node->par;
+                }
+                else {
+                    if (!is_red(sibling->lhs)) {
+                        sibling->rhs->balance = black;
+                        sibling->balance = red;
+                        rotate_left(sibling);
+                        sibling = par->lhs;
+                    }
+                    sibling->balance = par->balance;
+                    par->balance = black;
+                    sibling->lhs->balance = black;
+                    rotate_right(par);
+                    node = header_.par;
+                    par = &header_;
+                }
             }
         }
-        out->par = out->lhs = out->rhs = nullptr;
+        if (node) {
+            node->balance = black;
+        }
+    }
+
+
+    static std::int8_t height(const node_t* node) {
+        return node ? node->balance : 0;
+    }
+
+
+    static void update_height(node_t* node) {
+        node->balance = 1 + std::max(height(node->lhs), height(node->rhs));
+    }
 
-        return out; 
+
+    void avl_retrace(node_t* node) {
+        while (node != &header_) {
+            update_height(node);
+            int diff = height(node->lhs) - height(node->rhs);
+
+            if (diff > 1) {
+                if (height(node->lhs->lhs) < height(node->lhs->rhs)) {
+                    rotate_left(node->lhs);
+                }
+                node = rotate_right(node);
+            }
+            else if (diff < -1) {
+                if (height(node->rhs->rhs) < height(node->rhs->lhs)) {
+                    rotate_right(node->rhs);
+                }
+                node = rotate_left(node);
+            }
+            node = node->par;
+        }
     }
 
 
-    node_t* lower_bound(node_t* node, const value_type& value) const {
+    template <typename K>
+    node_t* lower_bound(node_t* node, const K& value) const {
         node_t* res = nullptr;
 
         while (node) {
-            if (comp_(node->value, value)) {
+            count_visit();
+            if (less(node->value, value)) {
                 node = node->rhs;
             }
             else {
@@ -493,11 +2575,13 @@ private:
     }
 
 
-    node_t* upper_bound(node_t* node, const value_type& value) const {
+    template <typename K>
+    node_t* upper_bound(node_t* node, const K& value) const {
         node_t* res = nullptr;
 
         while (node) {
-            if (comp_(value, node->value) && value != node->value) {
+            count_visit();
+            if (less(value, node->value)) {
                 res = node;
                 node = node->lhs;
             }
@@ -509,6 +2593,287 @@ private:
         return res; 
     }
 
+
+    static size_type subtree_count(const node_t* node) {
+        return node ? node->count : 0;
+    }
+
+
+    static void update_count(node_t* node) {
+        node->count = 1 + subtree_count(node->lhs) + subtree_count(node->rhs);
+    }
+
+
+    static void update_aggregate(node_t* node) {
+        typename aggregate_monoid::value_type res = aggregate_monoid::lift(node->value);
+        if (node->lhs) {
+            res = aggregate_monoid::combine(node->lhs->aggregate, res);
+        }
+        if (node->rhs) {
+            res = aggregate_monoid::combine(res, node->rhs->aggregate);
+        }
+        node->aggregate = std::move(res);
+    }
+
+
+    // recomputes what node keeps about its subtree from its children
+    static void update_augments(node_t* node) {
+        if constexpr (order_statistics) {
+            update_count(node);
+        }
+        if constexpr (aggregated) {
+            update_aggregate(node);
+        }
+    }
+
+
+    // k-th node in key order, nullptr past the end
+    node_t* select(size_type k) const {
+        node_t* node = header_.par;
+        while (node) {
+            size_type left = subtree_count(node->lhs);
+            if (k < left) {
+                node = node->lhs;
+            }
+            else if (k > left) {
+                k -= left + 1;
+                node = node->rhs;
+            }
+            else {
+                break;
+            }
+        }
+
+        return node;
+    }
+
+
+    // number of values ordered before value
+    template <typename K>
+    size_type rank_of(const K& value) const {
+        size_type res = 0;
+        node_t* node = header_.par;
+        while (node) {
+            if (comp_(node->value, value)) {
+                res += subtree_count(node->lhs) + 1;
+                node = node->rhs;
+            }
+            else {
+                node = node->lhs;
+            }
+        }
+
+        return res;
+    }
+
+
+    // index of node in Tag order, size_ for end()
+    size_type position(const node_t* node) const {
+        if (node->header) {
+            return size_;
+        }
+        size_type res;
+        if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            res = subtree_count(node->lhs);
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            res = 0;
+        }
+        else {
+            res = subtree_count(node->lhs) + subtree_count(node->rhs);
+        }
+
+        for (; !node->par->header; node = node->par) {
+            const node_t* par = node->par;
+            bool right = node == par->rhs;
+            if constexpr (std::is_same_v<Tag, in_order_tag>) {
+                res += right ? subtree_count(par->lhs) + 1 : 0;
+            }
+            else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+                res += right ? subtree_count(par->lhs) + 1 : 1;
+            }
+            else {
+                res += right ? subtree_count(par->lhs) : 0;
+            }
+        }
+
+        return res;
+    }
+
+
+    static void prefetch(const node_t* node) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(node);
+#endif
+    }
+
+
+    // one round moves every unfinished query a level down; exact stops at an equal value
+    template <
+        bool exact,
+        typename key_iter_t,
+        typename out_iter_t
+    >
+    out_iter_t walk_batch(key_iter_t lhs, key_iter_t rhs, out_iter_t out) const {
+        std::array<key_iter_t, batch_width> keys;
+        std::array<node_t*, batch_width> cur;
+        std::array<node_t*, batch_width> res;
+
+        while (lhs != rhs) {
+            std::size_t count = 0;
+            for (; count < batch_width && lhs != rhs; ++count, ++lhs) {
+                keys[count] = lhs;
+                cur[count] = header_.par;
+                res[count] = nullptr;
+            }
+
+            bool active = true;
+            while (active) {
+                active = false;
+                for (std::size_t i = 0; i < count; ++i) {
+                    node_t* node = cur[i];
+                    if (!node) {
+                        continue;
+                    }
+                    const auto& key = *keys[i];
+                    count_visit();
+                    if (less(node->value, key)) {
+                        node = node->rhs;
+                    }
+                    else if (exact && less(key, node->value)) {
+                        node = node->lhs;
+                    }
+                    else {
+                        res[i] = node;
+                        node = exact ? nullptr : node->lhs;
+                    }
+                    cur[i] = node;
+                    if (node) {
+                        prefetch(node);
+                        active = true;
+                    }
+                }
+            }
+
+            for (std::size_t i = 0; i < count; ++i) {
+                *out = make_iterator(or_end(res[i]));
+                ++out;
+            }
+        }
+
+        return out;
+    }
+
+
+    static void link_thread(node_t* lhs, node_t* rhs) {
+        lhs->next = rhs;
+        rhs->prev = lhs;
+    }
+
+
+    // splices node out of the thread, or puts replacement in its place
+    static void unthread(node_t* node, node_t* replacement = nullptr) {
+        if (replacement) {
+            link_thread(node->prev, replacement);
+            link_thread(replacement, node->next);
+        }
+        else {
+            link_thread(node->prev, node->next);
+        }
+    }
+
+
+    // threads a freshly linked leaf, its neighbours are next to par
+    void thread_leaf(node_t* node) {
+        node_t* par = node->par;
+        node_t* prev;
+        if (par == &header_) {
+            prev = &header_;
+        }
+        else if constexpr (std::is_same_v<Tag, in_order_tag>) {
+            prev = node == par->lhs ? par->prev : par;
+        }
+        else if constexpr (std::is_same_v<Tag, pre_order_tag>) {
+            if (node == par->lhs || !par->lhs) {
+                prev = par;
+            }
+            else {
+                prev = internal_iterator::last_leaf(par->lhs);
+            }
+        }
+        else {
+            if (node == par->rhs || !par->rhs) {
+                prev = par->prev;
+            }
+            else {
+                prev = internal_iterator::first_leaf(par->rhs)->prev;
+            }
+        }
+        node_t* next = prev->next;
+        link_thread(prev, node);
+        link_thread(node, next);
+    }
+
+
+    // relinks the whole thread from the structure, used after bulk changes
+    void thread_all() {
+        using structural_iterator = TreeIterator<T, Tag, node_t, false>;
+        node_t* prev = &header_;
+        structural_iterator end(&header_);
+        for (structural_iterator cur = ++structural_iterator(&header_); cur != end; ++cur) {
+            link_thread(prev, cur.node_);
+            prev = cur.node_;
+        }
+        link_thread(prev, &header_);
+    }
+
+
+    // A rotation keeps the rotated subtree contiguous in pre- and post-order and only reorders its
+    // pieces: two nodes and three subtrees, listed in the direction where each piece starts with
+    // its root (forward for pre-order, backward for post-order). Only the joints are relinked.
+    void rethread(std::array<node_t*, 5> before, std::array<node_t*, 5> after) {
+        constexpr bool forward = std::is_same_v<Tag, pre_order_tag>;
+        auto succ = [](node_t* node) {
+            return forward ? node->next : node->prev;
+        };
+        auto pred = [](node_t* node) {
+            return forward ? node->prev : node->next;
+        };
+        auto link = [](node_t* lhs, node_t* rhs) {
+            forward ? link_thread(lhs, rhs) : link_thread(rhs, lhs);
+        };
+
+        auto drop_empty = [](std::array<node_t*, 5>& pieces) {
+            return std::size_t(std::remove(pieces.begin(), pieces.end(), nullptr) - pieces.begin());
+        };
+        std::size_t count = drop_empty(before);
+        drop_empty(after);
+
+        // tails[i] ends before[i]; the joints of the old order are read before anything is relinked
+        std::array<node_t*, 5> tails;
+        for (std::size_t i = 0; i + 1 < count; ++i) {
+            tails[i] = pred(before[i + 1]);
+        }
+        node_t* outer_prev = pred(before[0]);
+        node_t* outer_next = nullptr;
+        if (after[count - 1] != before[count - 1]) {
+            node_t* last = before[count - 1];
+            tails[count - 1] = forward ? internal_iterator::last_leaf(last) : internal_iterator::first_leaf(last);
+            outer_next = succ(tails[count - 1]);
+        }
+        auto tail = [&](node_t* piece) {
+            return tails[std::find(before.begin(), before.begin() + count, piece) - before.begin()];
+        };
+
+        link(outer_prev, after[0]);
+        for (std::size_t i = 0; i + 1 < count; ++i) {
+            link(tail(after[i]), after[i + 1]);
+        }
+        if (outer_next) {
+            link(tail(after[count - 1]), outer_next);
+        }
+    }
+
 };
 
 
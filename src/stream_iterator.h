@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+
+// Input iterator over the raw values of a binary stream, read a chunk at a time into a small
+// buffer, so a multi-gigabyte dump can feed SearchTree's sorted_unique inserts without being
+// loaded whole. Copies share the buffer, like std::istreambuf_iterator; as with any buffered read
+// the stream may be consumed up to a chunk past the last value taken.
+template <typename T>
+class BinaryStreamIterator {
+    static_assert(std::is_trivially_copyable_v<T>, "values are read as raw bytes");
+public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    static constexpr std::size_t default_chunk = 4096;
+
+private:
+    struct State {
+        std::istream* in;
+        std::vector<T> buffer;
+        std::size_t pos;
+        std::size_t count;
+    };
+
+public:
+    // end of stream
+    BinaryStreamIterator() = default;
+
+    explicit BinaryStreamIterator(std::istream& in, std::size_t chunk = default_chunk)
+        : state_(std::make_shared<State>(State{ &in, std::vector<T>(chunk ? chunk : 1), 0, 0 })) {
+        refill();
+    }
+
+    reference operator *() const {
+        return state_->buffer[state_->pos];
+    }
+    pointer operator ->() const {
+        return &state_->buffer[state_->pos];
+    }
+
+    bool operator ==(const BinaryStreamIterator& arg) const {
+        return state_ == arg.state_;
+    }
+    bool operator !=(const BinaryStreamIterator& arg) const {
+        return state_ != arg.state_;
+    }
+
+    BinaryStreamIterator& operator ++() {
+        if (++state_->pos == state_->count) {
+            refill();
+        }
+
+        return *this;
+    }
+    // copies share the buffer, so the old value is kept apart for *it++, as istreambuf_iterator does
+    class postfix_proxy {
+    public:
+        explicit postfix_proxy(const T& value)
+            : value_(value) {}
+
+        reference operator *() const {
+            return value_;
+        }
+
+    private:
+        T value_;
+    };
+
+    postfix_proxy operator ++(int) {
+        postfix_proxy temp(**this);
+        ++*this;
+
+        return temp;
+    }
+
+private:
+    // a trailing partial value is dropped, the iterator turns into end() once nothing is left
+    void refill() {
+        State& state = *state_;
+        state.in->read(reinterpret_cast<char*>(state.buffer.data()), std::streamsize(state.buffer.size() * sizeof(T)));
+        state.count = std::size_t(state.in->gcount()) / sizeof(T);
+        state.pos = 0;
+        if (state.count == 0) {
+            state_.reset();
+        }
+    }
+
+private:
+    std::shared_ptr<State> state_;
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// Work-stealing pool for fork-join parallelism. Every worker owns a deque: it pushes and pops its
+// own forks at the back, idle workers steal from the front of the others, which takes the oldest
+// and so largest pieces of work. A thread waiting for a fork runs other tasks in the meantime, so
+// nested forks never block the pool; threads outside the pool share one extra deque.
+class ThreadPool {
+private:
+    // lives on the stack of the forking thread until it is done
+    struct Task {
+        void (*run)(void*);
+        void* arg;
+        std::exception_ptr error;
+        std::atomic<bool> done{false};
+    };
+
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+    };
+
+public:
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency())
+        : queues_(std::max<std::size_t>(threads, 1) + 1) {
+        workers_.reserve(queues_.size() - 1);
+        for (std::size_t i = 0; i + 1 < queues_.size(); ++i) {
+            workers_.emplace_back([this, i]() {
+                work(i);
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator =(const ThreadPool&) = delete;
+
+    // forks still running must have been joined
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        sleep_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+
+    // process-wide pool with a worker per hardware thread
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+
+        return pool;
+    }
+
+    std::size_t size() const {
+        return workers_.size();
+    }
+
+
+    // runs lhs here and rhs wherever a thread is free, returns once both are done; an exception
+    // from either is rethrown here, lhs's first
+    template <
+        typename lhs_t,
+        typename rhs_t
+    >
+    void fork_join(lhs_t&& lhs, rhs_t&& rhs) {
+        Task task;
+        task.run = [](void* arg) {
+            (*static_cast<std::remove_reference_t<rhs_t>*>(arg))();
+        };
+        task.arg = const_cast<void*>(static_cast<const void*>(std::addressof(rhs)));
+        Queue& queue = local_queue();
+        push(queue, &task);
+
+        try {
+            lhs();
+        }
+        catch (...) {
+            join(queue, task);
+            throw;
+        }
+        join(queue, task);
+        if (task.error) {
+            std::rethrow_exception(task.error);
+        }
+    }
+
+private:
+    Queue& local_queue() {
+        return current_pool_ == this ? queues_[current_index_] : queues_.back();
+    }
+
+
+    // counted before it is queued, so the count never drops below zero
+    void push(Queue& queue, Task* task) {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            ++queued_;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(task);
+        }
+        sleep_.notify_one();
+    }
+
+
+    static void run(Task* task) {
+        try {
+            task->run(task->arg);
+        }
+        catch (...) {
+            task->error = std::current_exception();
+        }
+        task->done.store(true, std::memory_order_release);
+    }
+
+
+    // the own queue is taken from the back, the others from the front
+    Task* take(Queue& own) {
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                Task* task = own.tasks.back();
+                own.tasks.pop_back();
+                --queued_;
+                return task;
+            }
+        }
+        for (Queue& queue : queues_) {
+            if (&queue == &own) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                Task* task = queue.tasks.front();
+                queue.tasks.pop_front();
+                --queued_;
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+
+    // runs task inline if nobody stole it, otherwise helps with other work until it is done
+    void join(Queue& queue, Task& task) {
+        bool stolen = true;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty() && queue.tasks.back() == &task) {
+                queue.tasks.pop_back();
+                --queued_;
+                stolen = false;
+            }
+        }
+        if (!stolen) {
+            run(&task);
+            return;
+        }
+
+        while (!task.done.load(std::memory_order_acquire)) {
+            if (Task* other = take(queue)) {
+                run(other);
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+
+    void work(std::size_t index) {
+        current_pool_ = this;
+        current_index_ = index;
+        while (true) {
+            if (Task* task = take(queues_[index])) {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleep_.wait(lock, [this]() {
+                return stop_ || queued_.load() > 0;
+            });
+            if (stop_ && queued_.load() == 0) {
+                return;
+            }
+        }
+    }
+
+private:
+    static inline thread_local ThreadPool* current_pool_ = nullptr;
+    static inline thread_local std::size_t current_index_ = 0;
+
+    // one per worker, the last one is shared by outside threads
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_;
+    // tasks sitting in any queue; raised under sleep_mutex_ so a sleeping worker cannot miss it
+    std::atomic<std::size_t> queued_{0};
+    bool stop_ = false;
+};
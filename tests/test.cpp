@@ -1,11 +1,25 @@
 #include <gtest/gtest.h>
 #include "src/search_tree.h"
+#include "src/pool_allocator.h"
+#include "src/btree.h"
+#include "src/concurrent_tree.h"
+#include "src/persistent_tree.h"
+#include "src/mapped_tree.h"
+#include "src/stream_iterator.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
 #include <vector>
 #include <numeric>
 #include <random>
 #include <set>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 
 
 
@@ -129,13 +143,56 @@ TEST(SearchTreeTest, EraseSingleElement) {
     EXPECT_EQ(it, tree.end());  
 }
 
+template <typename Tree>
+void CheckEraseRange() {
+    std::vector<int> keys = { 50, 20, 80, 10, 30, 70, 90, 25, 35, 60, 95, 5 };
+    Tree tree(keys.begin(), keys.end());
+    std::vector<int> order(tree.begin(), tree.end());
+
+    // a range out of the middle of the traversal, every value in it goes and nothing else
+    tree.erase(std::next(tree.begin(), 3), std::next(tree.begin(), 9));
+    std::multiset<int> expected(order.begin(), order.begin() + 3);
+    expected.insert(order.begin() + 9, order.end());
+    EXPECT_EQ(tree.size(), expected.size());
+    EXPECT_EQ(std::multiset<int>(tree.begin(), tree.end()), expected);
+
+    tree.erase(tree.begin(), tree.end());
+    EXPECT_TRUE(tree.empty());
+    EXPECT_EQ(tree.begin(), tree.end());
+
+    Tree full(keys.begin(), keys.end());
+    full.erase(std::next(full.begin()), full.end());
+    EXPECT_EQ(full.size(), 1);
+    EXPECT_EQ(*full.begin(), order.front());
+}
+
+TEST(SearchTreeTest, EraseRangeAllOrders) {
+    CheckEraseRange<SearchTree<int, in_order_tag>>();
+    CheckEraseRange<SearchTree<int, pre_order_tag>>();
+    CheckEraseRange<SearchTree<int, post_order_tag>>();
+    CheckEraseRange<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag>>();
+    CheckEraseRange<SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag>>();
+    CheckEraseRange<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, scapegoat_tag<>>>();
+    CheckEraseRange<SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int, threaded_tag>>, red_black_tag, threaded_tag>>();
+
+    // in-order keeps its order across an erase, so the loop over single erases still works there
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    for (int i = 0; i < 10; ++i) {
+        tree.insert(i);
+    }
+    for (auto it = tree.begin(); it != tree.end();) {
+        it = tree.erase(it);
+    }
+    EXPECT_TRUE(tree.empty());
+}
+
 TEST(SearchTreeTest, ExtractElement) {
     SearchTree<int, in_order_tag> tree;
     tree.insert(10);
     tree.insert(5);
 
-    auto* node = tree.extract(10);
-    EXPECT_EQ(node->value, 10);
+    auto node = tree.extract(10);
+    EXPECT_EQ(node.value(), 10);
     EXPECT_EQ(tree.size(), 1);
 
     auto it = tree.find(10);
@@ -446,4 +503,1969 @@ TEST(SearchTree, LargeRandomTest) {
             EXPECT_EQ(tree_upper, tree.end());
         }
     }
+}
+
+template <typename tree_t>
+void CheckAgainstSet(tree_t& tree, const std::set<int>& std_set) {
+    EXPECT_EQ(tree.size(), std_set.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), std_set.begin(), std_set.end()));
+}
+
+TEST(Balancing, RedBlackRotations) {
+    SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    tree.insert(1);
+    tree.insert(2);
+    tree.insert(3);
+
+    std::vector<int> expected = { 2, 1, 3 };
+    std::vector<int> result(tree.begin(), tree.end());
+
+    EXPECT_EQ(result, expected);
+}
+
+TEST(Balancing, AvlRotations) {
+    SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag> tree;
+    tree.insert(3);
+    tree.insert(1);
+    tree.insert(2);
+
+    std::vector<int> expected = { 2, 1, 3 };
+    std::vector<int> result(tree.begin(), tree.end());
+
+    EXPECT_EQ(result, expected);
+}
+
+template <typename tree_t>
+void SortedInsertEraseTest() {
+    const int num_elements = 200000;
+    tree_t tree;
+    std::set<int> std_set;
+
+    for (int i = 0; i < num_elements; ++i) {
+        tree.insert(i);
+        std_set.insert(i);
+    }
+    CheckAgainstSet(tree, std_set);
+
+    for (int i = 0; i < num_elements; i += 3) {
+        EXPECT_EQ(tree.erase(i), 1);
+        std_set.erase(i);
+    }
+    for (int i = num_elements - 1; i >= 0; i -= 7) {
+        tree.erase(i);
+        std_set.erase(i);
+    }
+    CheckAgainstSet(tree, std_set);
+
+    for (int i = 0; i < 1000; ++i) {
+        auto it = tree.lower_bound(i * 150);
+        auto set_it = std_set.lower_bound(i * 150);
+        if (set_it == std_set.end()) {
+            EXPECT_EQ(it, tree.end());
+        }
+        else {
+            EXPECT_EQ(*it, *set_it);
+        }
+    }
+
+    tree_t copy(tree);
+    CheckAgainstSet(copy, std_set);
+}
+
+TEST(Balancing, RedBlackSortedInput) {
+    SortedInsertEraseTest<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag>>();
+}
+
+TEST(Balancing, AvlSortedInput) {
+    SortedInsertEraseTest<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag>>();
+}
+
+TEST(Balancing, RandomInsertErase) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<> distrib(1, 5000);
+
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> rb_tree;
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag> avl_tree;
+    SearchTree<int, in_order_tag> plain_tree;
+    std::set<int> std_set;
+
+    for (int i = 0; i < 100000; ++i) {
+        int value = distrib(gen);
+        if (i % 2 == 0) {
+            rb_tree.insert(value);
+            avl_tree.insert(value);
+            plain_tree.insert(value);
+            std_set.insert(value);
+        }
+        else {
+            EXPECT_EQ(rb_tree.erase(value), std_set.count(value));
+            EXPECT_EQ(avl_tree.erase(value), std_set.count(value));
+            EXPECT_EQ(plain_tree.erase(value), std_set.count(value));
+            std_set.erase(value);
+        }
+    }
+
+    CheckAgainstSet(rb_tree, std_set);
+    CheckAgainstSet(avl_tree, std_set);
+    CheckAgainstSet(plain_tree, std_set);
+}
+
+TEST(PoolAllocator, ReusesFreedSlots) {
+    PoolAllocator<Node<int>> alloc;
+
+    Node<int>* first = alloc.allocate(1);
+    Node<int>* second = alloc.allocate(1);
+    EXPECT_NE(first, second);
+
+    alloc.deallocate(first, 1);
+    EXPECT_EQ(alloc.allocate(1), first);
+    EXPECT_EQ(alloc.chunk_count(), 1);
+
+    alloc.release();
+    EXPECT_EQ(alloc.chunk_count(), 0);
+}
+
+TEST(PoolAllocator, TreeWithPool) {
+    using tree_t = SearchTree<int, in_order_tag, std::less<int>, PoolAllocator<Node<int>>, red_black_tag>;
+    tree_t tree;
+    std::set<int> std_set;
+
+    for (int i = 0; i < 100000; ++i) {
+        tree.insert(i * 7 % 100003);
+        std_set.insert(i * 7 % 100003);
+    }
+    for (int i = 0; i < 100000; i += 2) {
+        tree.erase(i);
+        std_set.erase(i);
+    }
+    CheckAgainstSet(tree, std_set);
+
+    tree_t copy(tree);
+    EXPECT_NE(copy.get_allocator(), tree.get_allocator());
+    CheckAgainstSet(copy, std_set);
+
+    tree.clear();
+    EXPECT_TRUE(tree.empty());
+    EXPECT_EQ(tree.get_allocator().chunk_count(), 0);
+
+    tree.insert(5);
+    EXPECT_EQ(*tree.begin(), 5);
+    CheckAgainstSet(copy, std_set);
+}
+
+TEST(PoolAllocator, NonTrivialValues) {
+    SearchTree<std::string, in_order_tag, std::less<std::string>, PoolAllocator<Node<std::string>>> tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(std::string(40, 'a') + std::to_string(i));
+    }
+    tree.erase(std::string(40, 'a') + "10");
+
+    EXPECT_EQ(tree.size(), 999);
+    EXPECT_EQ(tree.find(std::string(40, 'a') + "10"), tree.end());
+}
+
+TEST(PoolAllocator, ReboundCopiesShareThePool) {
+    PoolAllocator<int> alloc;
+    PoolAllocator<Node<int>> rebound(alloc);
+    EXPECT_EQ(PoolAllocator<int>(rebound), alloc);
+    EXPECT_NE(PoolAllocator<int>(), alloc);
+
+    Node<int>* node = rebound.allocate(1);
+    EXPECT_EQ(alloc.chunk_count(), 1);
+    PoolAllocator<Node<int>>(PoolAllocator<int>(rebound)).deallocate(node, 1);
+    EXPECT_EQ(rebound.allocate(1), node);
+}
+
+TEST(PoolAllocator, SplitOutlivesSource) {
+    using tree_t = SearchTree<int, in_order_tag, std::less<int>, PoolAllocator<Node<int>>, red_black_tag, order_statistics_tag>;
+    auto tree = std::make_unique<tree_t>();
+    for (int i = 0; i < 100; ++i) {
+        tree->insert(i);
+    }
+
+    auto [lhs, rhs] = tree->split(50);
+    EXPECT_EQ(lhs.get_allocator(), rhs.get_allocator());
+    tree.reset();
+
+    int expected = 0;
+    for (int value : lhs) {
+        EXPECT_EQ(value, expected++);
+    }
+    EXPECT_EQ(expected, 50);
+    for (int value : rhs) {
+        EXPECT_EQ(value, expected++);
+    }
+    EXPECT_EQ(expected, 100);
+}
+
+TEST(DegenerateTree, CopySearchDestroy) {
+    const int num_elements = 30000;
+    auto tree = std::make_unique<SearchTree<int, in_order_tag>>();
+
+    for (int i = 0; i < num_elements; ++i) {
+        tree->insert(i);
+    }
+
+    auto copy = std::make_unique<SearchTree<int, in_order_tag>>(*tree);
+    EXPECT_EQ(copy->size(), num_elements);
+    EXPECT_EQ(*copy, *tree);
+
+    for (int i = 0; i < num_elements; i += 1000) {
+        EXPECT_EQ(*copy->find(i), i);
+    }
+    EXPECT_EQ(copy->find(num_elements), copy->end());
+
+    tree.reset();
+    copy->clear();
+    EXPECT_TRUE(copy->empty());
+}
+
+TEST(DegenerateTree, ConstLookup) {
+    SearchTree<int, in_order_tag> tree;
+    tree.insert(2);
+    tree.insert(1);
+    tree.insert(3);
+
+    const auto& const_tree = tree;
+    EXPECT_EQ(*const_tree.find(3), 3);
+    EXPECT_EQ(const_tree.find(4), const_tree.cend());
+}
+
+TEST(BulkBuild, SortedUniqueShape) {
+    std::vector<int> data = { 1, 2, 3, 4, 5, 6, 7 };
+    SearchTree<int, pre_order_tag> tree(sorted_unique, data.begin(), data.end());
+
+    std::vector<int> expected = { 4, 2, 1, 3, 6, 5, 7 };
+    std::vector<int> result(tree.begin(), tree.end());
+
+    EXPECT_EQ(tree.size(), data.size());
+    EXPECT_EQ(result, expected);
+}
+
+TEST(BulkBuild, DetectsSortedRange) {
+    std::vector<int> data(1000000);
+    std::iota(data.begin(), data.end(), 0);
+
+    SearchTree<int, in_order_tag> tree(data.begin(), data.end());
+    EXPECT_EQ(tree.size(), data.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), data.begin(), data.end()));
+    EXPECT_EQ(*tree.find(123456), 123456);
+}
+
+TEST(BulkBuild, MergeIntoNonEmptyTree) {
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    std::set<int> std_set;
+    for (int i = 0; i < 10000; i += 3) {
+        tree.insert(i);
+        std_set.insert(i);
+    }
+
+    std::vector<int> data;
+    for (int i = 0; i < 10000; i += 2) {
+        data.push_back(i);
+        std_set.insert(i);
+    }
+    tree.insert(sorted_unique, data.begin(), data.end());
+    CheckAgainstSet(tree, std_set);
+
+    for (int i = 0; i < 10000; i += 5) {
+        tree.erase(i);
+        std_set.erase(i);
+        tree.insert(i + 10000);
+        std_set.insert(i + 10000);
+    }
+    CheckAgainstSet(tree, std_set);
+}
+
+TEST(BulkBuild, BalancedPoliciesStayValid) {
+    std::vector<int> data(100000);
+    std::iota(data.begin(), data.end(), 0);
+    std::set<int> std_set(data.begin(), data.end());
+
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag> tree(sorted_unique, data.begin(), data.end());
+    for (int i = 0; i < 100000; i += 2) {
+        tree.erase(i);
+        std_set.erase(i);
+    }
+    for (int i = 100000; i < 200000; ++i) {
+        tree.insert(i);
+        std_set.insert(i);
+    }
+    CheckAgainstSet(tree, std_set);
+}
+
+TEST(HintedInsert, StdInserter) {
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    std::vector<int> data(100000);
+    std::iota(data.begin(), data.end(), 0);
+
+    std::copy(data.begin(), data.end(), std::inserter(tree, tree.end()));
+
+    EXPECT_EQ(tree.size(), data.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), data.begin(), data.end()));
+}
+
+TEST(HintedInsert, GoodAndBadHints) {
+    SearchTree<int, in_order_tag> tree;
+    tree.insert(10);
+    tree.insert(20);
+    tree.insert(30);
+
+    auto it = tree.insert(tree.find(20), 15);
+    EXPECT_EQ(*it, 15);
+    it = tree.insert(tree.find(20), 25);
+    EXPECT_EQ(*it, 25);
+    it = tree.insert(tree.find(10), 40);
+    EXPECT_EQ(*it, 40);
+    it = tree.insert(tree.end(), 5);
+    EXPECT_EQ(*it, 5);
+
+    it = tree.insert(tree.find(30), 20);
+    EXPECT_EQ(*it, 20);
+    EXPECT_EQ(it, tree.find(20));
+
+    std::vector<int> expected = { 5, 10, 15, 20, 25, 30, 40 };
+    std::vector<int> result(tree.begin(), tree.end());
+
+    EXPECT_EQ(tree.size(), expected.size());
+    EXPECT_EQ(result, expected);
+}
+
+TEST(HintedInsert, RandomHints) {
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<> distrib(1, 20000);
+
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag> tree;
+    std::set<int> std_set;
+    tree.insert(0);
+    std_set.insert(0);
+
+    for (int i = 0; i < 20000; ++i) {
+        int value = distrib(gen);
+        auto hint = tree.lower_bound(distrib(gen));
+        tree.insert(hint, value);
+        std_set.insert(value);
+    }
+    CheckAgainstSet(tree, std_set);
+}
+
+struct MoveOnlyKey {
+    std::unique_ptr<int> key;
+
+    explicit MoveOnlyKey(int value) : key(std::make_unique<int>(value)) {}
+
+    bool operator <(const MoveOnlyKey& other) const {
+        return *key < *other.key;
+    }
+};
+
+TEST(NodeHandles, EmplaceAndMoveInsert) {
+    SearchTree<MoveOnlyKey, in_order_tag> tree;
+
+    auto [it, inserted] = tree.emplace(5);
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(*it->key, 5);
+
+    EXPECT_TRUE(tree.insert(MoveOnlyKey(3)).second);
+    EXPECT_FALSE(tree.emplace(5).second);
+    EXPECT_EQ(*tree.emplace_hint(tree.end(), 7)->key, 7);
+
+    std::vector<int> expected = { 3, 5, 7 };
+    std::vector<int> result;
+    for (const auto& value : tree) {
+        result.push_back(*value.key);
+    }
+    EXPECT_EQ(result, expected);
+
+    SearchTree<std::string, in_order_tag> strings;
+    std::string value(100, 'x');
+    const char* data = value.data();
+    strings.insert(std::move(value));
+    EXPECT_EQ(strings.begin()->data(), data);
+}
+
+TEST(NodeHandles, ExtractAndReinsert) {
+    SearchTree<int, in_order_tag> tree;
+    tree.insert(10);
+    tree.insert(20);
+    tree.insert(30);
+
+    auto handle = tree.extract(20);
+    EXPECT_FALSE(handle.empty());
+    EXPECT_EQ(tree.size(), 2);
+
+    handle.value() = 25;
+    auto result = tree.insert(std::move(handle));
+    EXPECT_TRUE(result.inserted);
+    EXPECT_EQ(*result.position, 25);
+    EXPECT_TRUE(result.node.empty());
+
+    auto duplicate = tree.extract(tree.find(10));
+    tree.insert(10);
+    result = tree.insert(std::move(duplicate));
+    EXPECT_FALSE(result.inserted);
+    EXPECT_EQ(result.node.value(), 10);
+
+    EXPECT_TRUE(tree.extract(99).empty());
+
+    std::vector<int> expected = { 10, 25, 30 };
+    std::vector<int> values(tree.begin(), tree.end());
+    EXPECT_EQ(values, expected);
+}
+
+TEST(NodeHandles, MergeSplicesNodes) {
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag> source;
+    std::set<int> expected;
+
+    for (int i = 0; i < 1000; i += 2) {
+        tree.insert(i);
+        expected.insert(i);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        source.insert(i);
+        expected.insert(i);
+    }
+    const int* shared_address = &*source.find(3);
+
+    tree.merge(source);
+
+    CheckAgainstSet(tree, expected);
+    EXPECT_EQ(&*tree.find(3), shared_address);
+
+    std::set<int> left_over;
+    for (int i = 0; i < 1000; i += 6) {
+        left_over.insert(i);
+    }
+    std::vector<int> rest(source.begin(), source.end());
+    std::sort(rest.begin(), rest.end());
+    EXPECT_TRUE(std::equal(rest.begin(), rest.end(), left_over.begin(), left_over.end()));
+}
+
+TEST(BTree, Traversals) {
+    BTree<int, in_order_tag, std::less<int>, std::allocator<int>, 3> in_tree;
+    BTree<int, pre_order_tag, std::less<int>, std::allocator<int>, 3> pre_tree;
+    BTree<int, post_order_tag, std::less<int>, std::allocator<int>, 3> post_tree;
+    for (int i = 1; i <= 7; ++i) {
+        in_tree.insert(i);
+        pre_tree.insert(i);
+        post_tree.insert(i);
+    }
+
+    std::vector<int> in_expected = { 1, 2, 3, 4, 5, 6, 7 };
+    std::vector<int> pre_expected = { 2, 4, 1, 3, 5, 6, 7 };
+    std::vector<int> post_expected = { 1, 3, 5, 6, 7, 2, 4 };
+
+    EXPECT_EQ(std::vector<int>(in_tree.begin(), in_tree.end()), in_expected);
+    EXPECT_EQ(std::vector<int>(pre_tree.begin(), pre_tree.end()), pre_expected);
+    EXPECT_EQ(std::vector<int>(post_tree.begin(), post_tree.end()), post_expected);
+
+    std::vector<int> pre_reversed(pre_tree.rbegin(), pre_tree.rend());
+    std::reverse(pre_reversed.begin(), pre_reversed.end());
+    EXPECT_EQ(pre_reversed, pre_expected);
+
+    std::vector<int> post_reversed(post_tree.rbegin(), post_tree.rend());
+    std::reverse(post_reversed.begin(), post_reversed.end());
+    EXPECT_EQ(post_reversed, post_expected);
+}
+
+template <std::size_t Capacity>
+void BTreeRandomTest() {
+    std::mt19937 gen(3);
+    std::uniform_int_distribution<> distrib(1, 20000);
+
+    BTree<int, in_order_tag, std::less<int>, std::allocator<int>, Capacity> tree;
+    std::set<int> std_set;
+
+    for (int i = 0; i < 200000; ++i) {
+        int value = distrib(gen);
+        if (i % 3 != 2) {
+            EXPECT_EQ(tree.insert(value).second, std_set.insert(value).second);
+        }
+        else {
+            EXPECT_EQ(tree.erase(value), std_set.erase(value));
+        }
+    }
+    CheckAgainstSet(tree, std_set);
+
+    std::vector<int> reversed(tree.rbegin(), tree.rend());
+    EXPECT_TRUE(std::equal(reversed.begin(), reversed.end(), std_set.rbegin(), std_set.rend()));
+
+    for (int i = 0; i < 1000; ++i) {
+        int value = distrib(gen);
+        auto lower = tree.lower_bound(value);
+        auto set_lower = std_set.lower_bound(value);
+        EXPECT_EQ(lower == tree.end(), set_lower == std_set.end());
+        if (set_lower != std_set.end()) {
+            EXPECT_EQ(*lower, *set_lower);
+        }
+        auto upper = tree.upper_bound(value);
+        auto set_upper = std_set.upper_bound(value);
+        EXPECT_EQ(upper == tree.end(), set_upper == std_set.end());
+        if (set_upper != std_set.end()) {
+            EXPECT_EQ(*upper, *set_upper);
+        }
+        EXPECT_EQ(tree.find(value) != tree.end(), std_set.count(value) == 1);
+    }
+
+    auto copy = tree;
+    EXPECT_EQ(copy, tree);
+
+    auto it = tree.begin();
+    while (it != tree.end()) {
+        it = tree.erase(it);
+    }
+    EXPECT_TRUE(tree.empty());
+    CheckAgainstSet(copy, std_set);
+}
+
+TEST(BTree, RandomSmallNodes) {
+    BTreeRandomTest<3>();
+}
+
+TEST(BTree, RandomDefaultNodes) {
+    BTreeRandomTest<btree_capacity<int>()>();
+}
+
+TEST(BTree, StringKeys) {
+    BTree<std::string, in_order_tag, std::less<std::string>, std::allocator<std::string>, 5> tree;
+    std::set<std::string> std_set;
+    for (int i = 0; i < 5000; ++i) {
+        std::string value = std::string(30, 'k') + std::to_string(i * 7919 % 5000);
+        tree.insert(value);
+        std_set.insert(value);
+    }
+    for (int i = 0; i < 5000; i += 3) {
+        std::string value = std::string(30, 'k') + std::to_string(i);
+        EXPECT_EQ(tree.erase(value), std_set.erase(value));
+    }
+
+    EXPECT_EQ(tree.size(), std_set.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), std_set.begin(), std_set.end()));
+}
+
+TEST(BTree, EraseStoredKeys) {
+    // erase_key descends by value, which must not be a reference into the nodes it reshapes
+    BTree<std::string, in_order_tag, std::less<std::string>, std::allocator<std::string>, 3> tree;
+    std::set<std::string> std_set;
+    for (int i = 0; i < 400; ++i) {
+        std::string value = std::string(20, 'k') + std::to_string(i * 7919 % 400);
+        tree.insert(value);
+        std_set.insert(value);
+    }
+
+    std::mt19937 gen(17);
+    for (int i = 0; i < 100; ++i) {
+        auto it = std::next(tree.begin(), gen() % tree.size());
+        std::string value = *it;
+        if (i % 2) {
+            auto next = std_set.erase(std_set.find(value));
+            auto res = tree.erase(it);
+            EXPECT_EQ(res == tree.end(), next == std_set.end());
+            if (next != std_set.end()) {
+                EXPECT_EQ(*res, *next);
+            }
+        }
+        else {
+            EXPECT_EQ(tree.erase(*it), 1);
+            std_set.erase(value);
+        }
+        ASSERT_EQ(tree.size(), std_set.size());
+    }
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), std_set.begin(), std_set.end()));
+}
+
+TEST(FrozenTree, MatchesTree) {
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<> distrib(1, 200000);
+
+    SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    std::set<int> std_set;
+    for (int i = 0; i < 50000; ++i) {
+        int value = distrib(gen);
+        tree.insert(value);
+        std_set.insert(value);
+    }
+
+    FrozenTree<int> frozen = tree.freeze();
+    CheckAgainstSet(frozen, std_set);
+
+    std::vector<int> reversed(frozen.rbegin(), frozen.rend());
+    EXPECT_TRUE(std::equal(reversed.begin(), reversed.end(), std_set.rbegin(), std_set.rend()));
+
+    for (int i = 0; i < 10000; ++i) {
+        int value = distrib(gen);
+        auto lower = frozen.lower_bound(value);
+        auto set_lower = std_set.lower_bound(value);
+        EXPECT_EQ(lower == frozen.end(), set_lower == std_set.end());
+        if (set_lower != std_set.end()) {
+            EXPECT_EQ(*lower, *set_lower);
+        }
+        auto upper = frozen.upper_bound(value);
+        auto set_upper = std_set.upper_bound(value);
+        EXPECT_EQ(upper == frozen.end(), set_upper == std_set.end());
+        if (set_upper != std_set.end()) {
+            EXPECT_EQ(*upper, *set_upper);
+        }
+        EXPECT_EQ(frozen.find(value) != frozen.end(), std_set.count(value) == 1);
+    }
+}
+
+TEST(FrozenTree, SmallAndEmpty) {
+    SearchTree<std::string, in_order_tag> tree;
+    FrozenTree<std::string> empty = tree.freeze();
+    EXPECT_TRUE(empty.empty());
+    EXPECT_EQ(empty.begin(), empty.end());
+    EXPECT_EQ(empty.find("a"), empty.end());
+
+    tree.insert("b");
+    tree.insert("a");
+    tree.insert("c");
+    FrozenTree<std::string> frozen = tree.freeze();
+    FrozenTree<std::string> copy = frozen;
+
+    std::vector<std::string> expected = { "a", "b", "c" };
+    EXPECT_EQ(std::vector<std::string>(copy.begin(), copy.end()), expected);
+    EXPECT_EQ(*frozen.upper_bound("a"), "b");
+    EXPECT_EQ(frozen.lower_bound("d"), frozen.end());
+}
+
+struct ThrowingKey {
+    static inline int alive = 0;
+    static inline int copies_left = 0;
+
+    ThrowingKey(int key) : key(key) {
+        ++alive;
+    }
+    ThrowingKey(const ThrowingKey& other) : key(other.key) {
+        if (copies_left-- == 0) {
+            throw std::runtime_error("copy");
+        }
+        ++alive;
+    }
+    ~ThrowingKey() {
+        --alive;
+    }
+
+    bool operator <(const ThrowingKey& other) const {
+        return key < other.key;
+    }
+
+    int key;
+};
+
+TEST(FrozenTree, ThrowingCopyDestroysBuiltValues) {
+    std::vector<ThrowingKey> keys;
+    keys.reserve(20);
+    for (int i = 0; i < 20; ++i) {
+        keys.emplace_back(i);
+    }
+    for (int built : { 0, 1, 7, 13, 19 }) {
+        ThrowingKey::copies_left = built;
+        EXPECT_THROW(FrozenTree<ThrowingKey>(sorted_unique, keys.begin(), keys.end()), std::runtime_error);
+        EXPECT_EQ(ThrowingKey::alive, 20);
+    }
+
+    ThrowingKey::copies_left = 20;
+    FrozenTree<ThrowingKey> frozen(sorted_unique, keys.begin(), keys.end());
+    for (int built : { 0, 9, 19 }) {
+        ThrowingKey::copies_left = built;
+        EXPECT_THROW(FrozenTree<ThrowingKey> copy(frozen), std::runtime_error);
+        EXPECT_EQ(ThrowingKey::alive, 40);
+    }
+}
+
+TEST(BulkBuild, ThrowingCopyLeavesTreeIntact) {
+    std::vector<ThrowingKey> keys;
+    keys.reserve(20);
+    for (int i = 0; i < 20; ++i) {
+        keys.emplace_back(i);
+    }
+
+    using tree_t = SearchTree<ThrowingKey, in_order_tag, std::less<ThrowingKey>, std::allocator<Node<ThrowingKey>>, red_black_tag>;
+    for (int built : { 0, 5, 17 }) {
+        tree_t tree;
+        ThrowingKey::copies_left = built;
+        EXPECT_THROW(tree.insert(sorted_unique, keys.begin(), keys.end()), std::runtime_error);
+        EXPECT_TRUE(tree.empty());
+        EXPECT_EQ(ThrowingKey::alive, 20);
+
+        ThrowingKey::copies_left = 3;
+        tree.insert(keys[4]);
+        tree.insert(keys[12]);
+        ThrowingKey::copies_left = built;
+        EXPECT_THROW(tree.insert(sorted_unique, keys.begin(), keys.end()), std::runtime_error);
+        EXPECT_EQ(tree.size(), 2);
+        EXPECT_EQ(ThrowingKey::alive, 22);
+    }
+}
+
+TEST(SearchTreeTest, ThrowingCopyAssignmentLeavesEmptyTree) {
+    using tree_t = SearchTree<ThrowingKey, pre_order_tag>;
+    tree_t source;
+    tree_t target;
+    ThrowingKey::copies_left = 30;
+    for (int i = 0; i < 10; ++i) {
+        source.insert(ThrowingKey(i));
+        target.insert(ThrowingKey(i + 100));
+    }
+
+    ThrowingKey::copies_left = 4;
+    EXPECT_THROW(target = source, std::runtime_error);
+    EXPECT_TRUE(target.empty());
+    EXPECT_EQ(target.size(), 0);
+    EXPECT_EQ(target.begin(), target.end());
+    EXPECT_EQ(ThrowingKey::alive, 10);
+
+    ThrowingKey::copies_left = 10;
+    target = source;
+    EXPECT_EQ(target.size(), 10);
+}
+
+TEST(PersistentSearchTree, ThrowingCopyReleasesPath) {
+    // ascending keys rebalance at almost every insert, so copies fail inside the rotations too
+    for (int budget = 0; budget < 40; ++budget) {
+        {
+            PersistentSearchTree<ThrowingKey, in_order_tag> tree;
+            ThrowingKey::copies_left = 1000;
+            for (int i = 0; i < 31; ++i) {
+                tree.insert(ThrowingKey(i));
+            }
+            auto snapshot = tree.snapshot();
+
+            ThrowingKey::copies_left = budget;
+            try {
+                tree.insert(ThrowingKey(31));
+                tree.insert(ThrowingKey(32));
+            }
+            catch (const std::runtime_error&) {
+            }
+            ThrowingKey::copies_left = 1000;
+            EXPECT_EQ(snapshot.size(), 31);
+            EXPECT_EQ(std::distance(tree.begin(), tree.end()), std::ptrdiff_t(tree.size()));
+        }
+        EXPECT_EQ(ThrowingKey::alive, 0) << budget;
+    }
+}
+
+struct CountedKey {
+    static inline int constructed = 0;
+
+    CountedKey(int key) : key(key) {
+        ++constructed;
+    }
+    CountedKey(const CountedKey& other) : key(other.key) {
+        ++constructed;
+    }
+
+    int key;
+};
+
+struct CountedKeyLess {
+    using is_transparent = void;
+
+    bool operator ()(const CountedKey& a, const CountedKey& b) const { return a.key < b.key; }
+    bool operator ()(const CountedKey& a, int b) const { return a.key < b; }
+    bool operator ()(int a, const CountedKey& b) const { return a < b.key; }
+};
+
+TEST(TransparentLookup, StringView) {
+    SearchTree<std::string, in_order_tag, std::less<>, std::allocator<Node<std::string>>, red_black_tag> tree;
+    for (const char* word : { "delta", "alpha", "echo", "bravo", "charlie" }) {
+        tree.insert(word);
+    }
+
+    char buffer[] = "xxbravoxx";
+    std::string_view key(buffer + 2, 5);
+    EXPECT_EQ(*tree.find(key), "bravo");
+    EXPECT_EQ(tree.find(std::string_view("foxtrot")), tree.end());
+    EXPECT_EQ(*tree.lower_bound(std::string_view("c")), "charlie");
+    EXPECT_EQ(*tree.upper_bound(std::string_view("charlie")), "delta");
+
+    auto [lhs, rhs] = tree.equal_range(std::string_view("echo"));
+    EXPECT_EQ(*lhs, "echo");
+    EXPECT_EQ(rhs, tree.end());
+
+    EXPECT_EQ(tree.extract(std::string_view("alpha")).value(), "alpha");
+    EXPECT_EQ(tree.erase(std::string_view("delta")), 1);
+    EXPECT_EQ(tree.erase(std::string_view("delta")), 0);
+
+    std::vector<std::string> expected = { "bravo", "charlie", "echo" };
+    EXPECT_EQ(std::vector<std::string>(tree.begin(), tree.end()), expected);
+}
+
+TEST(TransparentLookup, NoKeyConstruction) {
+    SearchTree<CountedKey, post_order_tag, CountedKeyLess, std::allocator<Node<CountedKey>>, avl_tag> tree;
+    for (int i = 0; i < 100; ++i) {
+        tree.insert(CountedKey(i * 2));
+    }
+
+    CountedKey::constructed = 0;
+    for (int i = 0; i < 199; ++i) {
+        EXPECT_EQ(tree.find(i) != tree.end(), i % 2 == 0);
+        EXPECT_EQ(tree.lower_bound(i)->key, i + i % 2);
+    }
+    EXPECT_EQ(tree.erase(10), 1);
+    EXPECT_TRUE(tree.extract(20));
+    EXPECT_EQ(CountedKey::constructed, 0);
+    EXPECT_EQ(tree.size(), 98);
+}
+
+template <
+    traversalTag Tag,
+    balanceTag Balance
+>
+void OrderStatisticsRandomTest() {
+    std::mt19937 gen(17);
+    std::uniform_int_distribution<> distrib(1, 3000);
+
+    SearchTree<int, Tag, std::less<int>, std::allocator<Node<int>>, Balance, order_statistics_tag> tree;
+    std::set<int> std_set;
+    for (int i = 0; i < 4000; ++i) {
+        int value = distrib(gen);
+        if (i % 3 == 2) {
+            tree.erase(value);
+            std_set.erase(value);
+        }
+        else {
+            tree.insert(value);
+            std_set.insert(value);
+        }
+    }
+    std::vector<int> sorted(std_set.begin(), std_set.end());
+
+    for (size_t k = 0; k < sorted.size(); k += 7) {
+        EXPECT_EQ(*tree.nth(k), sorted[k]);
+    }
+    EXPECT_EQ(tree.nth(sorted.size()), tree.cend());
+
+    for (int i = 0; i < 500; ++i) {
+        int lo = distrib(gen);
+        int hi = distrib(gen);
+        size_t rank = std::lower_bound(sorted.begin(), sorted.end(), lo) - sorted.begin();
+        EXPECT_EQ(tree.rank(lo), rank);
+        size_t expected = lo < hi ? std::distance(std_set.lower_bound(lo), std_set.lower_bound(hi)) : 0;
+        EXPECT_EQ(tree.count_range(lo, hi), expected);
+    }
+
+    auto first = tree.cbegin();
+    std::ptrdiff_t index = 0;
+    for (auto it = tree.cbegin(); it != tree.cend(); ++it, ++index) {
+        EXPECT_EQ(tree.distance(first, it), index);
+    }
+    EXPECT_EQ(tree.distance(first, tree.cend()), std::ptrdiff_t(tree.size()));
+}
+
+TEST(OrderStatistics, RandomOperations) {
+    OrderStatisticsRandomTest<in_order_tag, red_black_tag>();
+    OrderStatisticsRandomTest<pre_order_tag, avl_tag>();
+    OrderStatisticsRandomTest<post_order_tag, no_balance_tag>();
+}
+
+TEST(OrderStatistics, BulkBuildCopyAndMerge) {
+    using tree_t = SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag, order_statistics_tag>;
+    std::vector<int> evens(100);
+    std::vector<int> odds(100);
+    for (int i = 0; i < 100; ++i) {
+        evens[i] = 2 * i;
+        odds[i] = 2 * i + 1;
+    }
+
+    tree_t tree(sorted_unique, evens.begin(), evens.end());
+    tree.insert(sorted_unique, odds.begin(), odds.begin() + 50);
+    tree_t copy = tree;
+    EXPECT_EQ(*copy.nth(101), 102);
+    EXPECT_EQ(copy.rank(150), 125);
+
+    tree_t other(sorted_unique, odds.begin() + 50, odds.end());
+    tree.merge(other);
+    EXPECT_TRUE(other.empty());
+    for (int k = 0; k < 200; ++k) {
+        EXPECT_EQ(*tree.nth(k), k);
+        EXPECT_EQ(tree.rank(k), size_t(k));
+    }
+
+    auto node = tree.extract(0);
+    tree.insert(std::move(node));
+    EXPECT_EQ(tree.count_range(10, 20), 10);
+}
+
+template <traversalTag Tag>
+void CheckReverseTraversal() {
+    SearchTree<int, Tag> tree;
+    for (int value : { 50, 30, 70, 20, 40, 60, 80, 35, 45, 65, 10 }) {
+        tree.insert(value);
+    }
+
+    std::vector<int> forward(tree.begin(), tree.end());
+    std::vector<int> backward(tree.rbegin(), tree.rend());
+    std::reverse(backward.begin(), backward.end());
+    EXPECT_EQ(forward, backward);
+}
+
+TEST(HeaderNode, ReverseTraversalAllOrders) {
+    CheckReverseTraversal<in_order_tag>();
+    CheckReverseTraversal<pre_order_tag>();
+    CheckReverseTraversal<post_order_tag>();
+}
+
+TEST(HeaderNode, SinglePointerIterators) {
+    EXPECT_EQ(sizeof(SearchTree<int, in_order_tag>::iterator), sizeof(void*));
+
+    SearchTree<int, post_order_tag> empty;
+    EXPECT_EQ(empty.begin(), empty.end());
+    EXPECT_EQ(empty.find(1), empty.end());
+}
+
+TEST(HeaderNode, EndSurvivesModification) {
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    auto end = tree.end();
+    for (int i = 0; i < 100; ++i) {
+        tree.insert(i);
+    }
+    EXPECT_EQ(tree.end(), end);
+    EXPECT_EQ(*std::prev(end), 99);
+    tree.erase(99);
+    EXPECT_EQ(*std::prev(end), 98);
+    EXPECT_EQ(*tree.begin(), 0);
+
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> other;
+    other.insert(-1);
+    tree.swap(other);
+    EXPECT_EQ(*std::prev(tree.end()), -1);
+    EXPECT_EQ(*std::prev(other.end()), 98);
+    EXPECT_EQ(tree.end(), end);
+}
+
+template <
+    traversalTag Tag,
+    balanceTag Balance
+>
+void ThreadedMatchesStructural() {
+    using plain_t = SearchTree<int, Tag, std::less<int>, std::allocator<Node<int>>, Balance>;
+    using threaded_t = SearchTree<int, Tag, std::less<int>, std::allocator<Node<int>>, Balance, threaded_tag>;
+
+    std::mt19937 gen(5);
+    std::uniform_int_distribution<> distrib(1, 2000);
+    plain_t plain;
+    threaded_t threaded;
+    for (int i = 0; i < 6000; ++i) {
+        int value = distrib(gen);
+        switch (i % 4) {
+            case 0:
+            case 1:
+                plain.insert(value);
+                threaded.insert(value);
+                break;
+            case 2:
+                plain.erase(value);
+                threaded.erase(value);
+                break;
+            case 3:
+                plain.insert(plain.extract(value));
+                threaded.insert(threaded.extract(value));
+                break;
+        }
+    }
+    EXPECT_TRUE(std::equal(plain.begin(), plain.end(), threaded.begin(), threaded.end()));
+    EXPECT_TRUE(std::equal(plain.rbegin(), plain.rend(), threaded.rbegin(), threaded.rend()));
+
+    std::vector<int> extra = { -3, -2, -1 };
+    plain.insert(sorted_unique, extra.begin(), extra.end());
+    threaded.insert(sorted_unique, extra.begin(), extra.end());
+    threaded_t source(sorted_unique, extra.begin(), extra.end());
+    threaded_t copy = threaded;
+    copy.merge(source);
+    EXPECT_TRUE(std::equal(plain.begin(), plain.end(), copy.begin(), copy.end()));
+    EXPECT_TRUE(std::equal(plain.rbegin(), plain.rend(), copy.rbegin(), copy.rend()));
+}
+
+TEST(Threaded, MatchesStructuralOrder) {
+    ThreadedMatchesStructural<in_order_tag, red_black_tag>();
+    ThreadedMatchesStructural<pre_order_tag, red_black_tag>();
+    ThreadedMatchesStructural<post_order_tag, red_black_tag>();
+    ThreadedMatchesStructural<pre_order_tag, avl_tag>();
+    ThreadedMatchesStructural<post_order_tag, avl_tag>();
+    ThreadedMatchesStructural<post_order_tag, no_balance_tag>();
+}
+
+TEST(Threaded, CombinedWithOrderStatistics) {
+    SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag,
+        augments<order_statistics_tag, threaded_tag>> tree;
+    for (int i = 0; i < 100; ++i) {
+        tree.insert(i);
+    }
+    EXPECT_EQ(*tree.nth(42), 42);
+    EXPECT_EQ(tree.distance(tree.cbegin(), std::next(tree.cbegin(), 10)), 10);
+    EXPECT_EQ(std::next(tree.cbegin(), tree.distance(tree.cbegin(), tree.nth(42))), tree.nth(42));
+    EXPECT_EQ(tree.distance(tree.cbegin(), tree.cend()), 100);
+}
+
+TEST(BatchLookup, MatchesSingleLookups) {
+    std::mt19937 gen(23);
+    std::uniform_int_distribution<> distrib(1, 20000);
+
+    SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    for (int i = 0; i < 5000; ++i) {
+        tree.insert(distrib(gen));
+    }
+    std::vector<int> keys(1000);
+    for (int& key : keys) {
+        key = distrib(gen);
+    }
+    keys.push_back(30000);
+
+    std::vector<decltype(tree)::iterator> found;
+    tree.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+    std::vector<decltype(tree)::iterator> lower(keys.size());
+    auto out = tree.lower_bound_batch(keys.begin(), keys.end(), lower.begin());
+    EXPECT_EQ(out, lower.end());
+
+    ASSERT_EQ(found.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        EXPECT_EQ(found[i], tree.find(keys[i]));
+        EXPECT_EQ(lower[i], tree.lower_bound(keys[i]));
+    }
+
+    SearchTree<int, in_order_tag> empty;
+    std::vector<decltype(empty)::iterator> none;
+    empty.find_batch(keys.begin(), keys.begin() + 3, std::back_inserter(none));
+    EXPECT_EQ(none, std::vector<decltype(empty)::iterator>(3, empty.end()));
+}
+
+TEST(EpochDomain, PinsBeyondOneBlock) {
+    static int reclaimed = 0;
+    reclaimed = 0;
+    auto reclaim = [](void* object) {
+        delete static_cast<int*>(object);
+        ++reclaimed;
+    };
+    {
+        EpochDomain domain;
+        std::vector<EpochDomain::Guard> guards;
+        for (std::size_t i = 0; i < 3 * EpochDomain::slots_per_block; ++i) {
+            guards.push_back(domain.pin());
+        }
+        // the readers pinned in the first epoch hold back everything retired meanwhile
+        for (int i = 0; i < 500; ++i) {
+            auto writer = domain.pin();
+            domain.retire(writer, new int(i), reclaim);
+        }
+        EXPECT_EQ(reclaimed, 0);
+
+        guards.clear();
+        for (int i = 0; i < 500; ++i) {
+            auto writer = domain.pin();
+            domain.retire(writer, new int(i), reclaim);
+        }
+        EXPECT_GT(reclaimed, 0);
+    }
+    EXPECT_EQ(reclaimed, 1000);
+}
+
+TEST(ConcurrentSearchTree, SingleThread) {
+    ConcurrentSearchTree<int> tree;
+    std::set<int> std_set;
+    std::mt19937 gen(29);
+    std::uniform_int_distribution<> distrib(1, 500);
+
+    for (int i = 0; i < 3000; ++i) {
+        int value = distrib(gen);
+        if (i % 3 == 2) {
+            EXPECT_EQ(tree.erase(value), std_set.erase(value));
+        }
+        else {
+            EXPECT_EQ(tree.insert(value), std_set.insert(value).second);
+        }
+    }
+    EXPECT_EQ(tree.size(), std_set.size());
+
+    std::vector<int> values;
+    tree.for_each([&values](int value) { values.push_back(value); });
+    EXPECT_TRUE(std::equal(values.begin(), values.end(), std_set.begin(), std_set.end()));
+
+    for (int value = 0; value <= 501; ++value) {
+        EXPECT_EQ(tree.contains(value), std_set.count(value) == 1);
+        auto lower = tree.lower_bound(value);
+        auto set_lower = std_set.lower_bound(value);
+        EXPECT_EQ(lower.has_value(), set_lower != std_set.end());
+        if (lower) {
+            EXPECT_EQ(*lower, *set_lower);
+        }
+    }
+}
+
+TEST(ConcurrentSearchTree, ReadersDuringWrites) {
+    ConcurrentSearchTree<int> tree;
+    for (int i = 0; i < 2000; i += 2) {
+        tree.insert(i);
+    }
+
+    std::atomic<bool> done = false;
+    std::atomic<int> misses = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&tree, &done, &misses, t]() {
+            std::mt19937 gen(t);
+            while (!done.load()) {
+                int even = 2 * int(gen() % 1000);
+                if (tree.find(even) != even) {
+                    ++misses;
+                }
+                int previous = -1;
+                tree.for_each([&previous, &misses](int value) {
+                    if (value <= previous) {
+                        ++misses;
+                    }
+                    previous = value;
+                });
+            }
+        });
+    }
+
+    std::mt19937 gen(31);
+    for (int i = 0; i < 20000; ++i) {
+        int odd = 2 * int(gen() % 1000) + 1;
+        if (i % 2) {
+            tree.insert(odd);
+        }
+        else {
+            tree.erase(odd);
+        }
+    }
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+
+    EXPECT_EQ(misses.load(), 0);
+    for (int i = 0; i < 2000; i += 2) {
+        EXPECT_TRUE(tree.contains(i));
+    }
+}
+
+TEST(ConcurrentSearchTree, ParallelWriters) {
+    constexpr int threads = 8;
+    constexpr int range = 4000;
+    ConcurrentSearchTree<int> tree;
+    std::vector<std::set<int>> expected(threads);
+    std::atomic<int> inserted = 0;
+
+    // every thread owns the keys of its residue class, so all of them write all over the tree
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([&tree, &expected, &inserted, t]() {
+            std::mt19937 gen(t);
+            for (int i = 0; i < 5000; ++i) {
+                int value = int(gen() % (range / threads)) * threads + t;
+                if (gen() % 3 == 0) {
+                    EXPECT_EQ(tree.erase(value), expected[t].erase(value));
+                }
+                else {
+                    EXPECT_EQ(tree.insert(value), expected[t].insert(value).second);
+                }
+            }
+            // then all threads race on the same keys, each must go in exactly once
+            for (int value = range; value < range + 500; ++value) {
+                if (tree.insert(value)) {
+                    ++inserted;
+                }
+            }
+        });
+    }
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+
+    std::set<int> reference;
+    for (const std::set<int>& part : expected) {
+        reference.insert(part.begin(), part.end());
+    }
+    for (int value = range; value < range + 500; ++value) {
+        reference.insert(value);
+    }
+    EXPECT_EQ(inserted.load(), 500);
+
+    std::vector<int> values;
+    tree.for_each([&values](int value) { values.push_back(value); });
+    EXPECT_TRUE(std::equal(values.begin(), values.end(), reference.begin(), reference.end()));
+    EXPECT_EQ(tree.size(), reference.size());
+}
+
+TEST(ConcurrentSearchTree, InsertEraseRace) {
+    constexpr int threads = 8;
+    constexpr int range = 64;
+    ConcurrentSearchTree<int> tree;
+    // successful inserts minus successful erases, per key; each one ends up 0 or 1
+    std::vector<std::atomic<int>> balance(range);
+
+    // all threads insert and erase the same few keys, so the same leaves and their neighbours are
+    // linked and unlinked from under each other all the time
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([&tree, &balance, t]() {
+            std::mt19937 gen(t);
+            for (int i = 0; i < 20000; ++i) {
+                int value = int(gen() % range);
+                if (gen() % 2) {
+                    balance[value] += tree.insert(value) ? 1 : 0;
+                }
+                else {
+                    balance[value] -= int(tree.erase(value));
+                }
+            }
+        });
+    }
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+
+    std::vector<int> reference;
+    for (int value = 0; value < range; ++value) {
+        int present = balance[value].load();
+        ASSERT_TRUE(present == 0 || present == 1) << value;
+        EXPECT_EQ(tree.contains(value), present == 1);
+        if (present) {
+            reference.push_back(value);
+        }
+    }
+
+    std::vector<int> values;
+    tree.for_each([&values](int value) { values.push_back(value); });
+    EXPECT_EQ(values, reference);
+    EXPECT_EQ(tree.size(), reference.size());
+}
+
+TEST(PersistentSearchTree, SnapshotsKeepTheirVersion) {
+    PersistentSearchTree<int, in_order_tag> tree;
+    std::set<int> reference;
+    std::vector<PersistentSearchTree<int, in_order_tag>> versions;
+    std::vector<std::set<int>> expected;
+
+    std::mt19937 gen(16);
+    for (int i = 0; i < 3000; ++i) {
+        int value = int(gen() % 500);
+        if (gen() % 3 == 0) {
+            EXPECT_EQ(tree.erase(value), reference.erase(value));
+        }
+        else {
+            EXPECT_EQ(tree.insert(value), reference.insert(value).second);
+        }
+        if (i % 300 == 0) {
+            versions.push_back(tree.snapshot());
+            expected.push_back(reference);
+        }
+    }
+    tree.clear();
+
+    for (std::size_t i = 0; i < versions.size(); ++i) {
+        EXPECT_EQ(versions[i].size(), expected[i].size());
+        EXPECT_TRUE(std::equal(versions[i].begin(), versions[i].end(), expected[i].begin(), expected[i].end()));
+        EXPECT_TRUE(std::equal(versions[i].rbegin(), versions[i].rend(), expected[i].rbegin(), expected[i].rend()));
+        for (int value = -1; value <= 500; value += 7) {
+            EXPECT_EQ(versions[i].contains(value), expected[i].count(value) == 1);
+            auto lower = versions[i].lower_bound(value);
+            auto it = expected[i].lower_bound(value);
+            EXPECT_EQ(lower == versions[i].end(), it == expected[i].end());
+            if (it != expected[i].end()) {
+                EXPECT_EQ(*lower, *it);
+            }
+        }
+    }
+}
+
+template <traversalTag Tag>
+void CheckPersistentTraversal() {
+    PersistentSearchTree<int, Tag> tree;
+    std::set<int> reference;
+    for (int value : { 50, 30, 70, 20, 40, 60, 80, 35, 45, 65, 10, 5, 1, 90, 85 }) {
+        tree.insert(value);
+        reference.insert(value);
+    }
+    auto snapshot = tree.snapshot();
+    tree.erase(50);
+    tree.erase(5);
+
+    std::vector<int> forward(snapshot.begin(), snapshot.end());
+    std::vector<int> backward(snapshot.rbegin(), snapshot.rend());
+    std::reverse(backward.begin(), backward.end());
+    EXPECT_EQ(forward, backward);
+    std::sort(forward.begin(), forward.end());
+    EXPECT_TRUE(std::equal(forward.begin(), forward.end(), reference.begin(), reference.end()));
+    EXPECT_EQ(std::distance(tree.begin(), tree.end()), 13);
+}
+
+TEST(PersistentSearchTree, TraversalOrders) {
+    CheckPersistentTraversal<in_order_tag>();
+    CheckPersistentTraversal<pre_order_tag>();
+    CheckPersistentTraversal<post_order_tag>();
+}
+
+TEST(PersistentSearchTree, PathCopying) {
+    PersistentSearchTree<CountedKey, pre_order_tag, CountedKeyLess> tree;
+    for (int i = 0; i < 1 << 14; ++i) {
+        tree.insert(CountedKey(i));
+    }
+
+    CountedKey::constructed = 0;
+    auto snapshot = tree.snapshot();
+    EXPECT_EQ(CountedKey::constructed, 0);
+
+    // a balanced tree of 2^14 keys is at most 20 deep, rotations add a few copies
+    tree.insert(CountedKey(-1));
+    EXPECT_LE(CountedKey::constructed, 64);
+    CountedKey::constructed = 0;
+    tree.erase(CountedKey(1 << 13));
+    EXPECT_LE(CountedKey::constructed, 64);
+
+    EXPECT_EQ(snapshot.size(), std::size_t(1) << 14);
+    EXPECT_EQ(tree.size(), std::size_t(1) << 14);
+    EXPECT_FALSE(snapshot.contains(CountedKey(-1)));
+    EXPECT_TRUE(snapshot.contains(CountedKey(1 << 13)));
+    EXPECT_FALSE(tree.contains(CountedKey(1 << 13)));
+}
+
+template <typename Tree>
+void CheckSplitJoin() {
+    Tree tree;
+    std::set<int> reference;
+    std::mt19937 gen(17);
+    for (int i = 0; i < 2000; ++i) {
+        int value = int(gen() % 5000);
+        tree.insert(value);
+        reference.insert(value);
+    }
+
+    for (int key : { -1, 0, 1234, 2500, 2501, 4999, 5000, 7000 }) {
+        auto [lhs, rhs] = tree.split(key);
+        EXPECT_TRUE(tree.empty());
+        std::set<int> expected_lhs(reference.begin(), reference.lower_bound(key));
+        std::set<int> expected_rhs(reference.lower_bound(key), reference.end());
+        EXPECT_EQ(lhs.size(), expected_lhs.size());
+        EXPECT_EQ(rhs.size(), expected_rhs.size());
+        EXPECT_TRUE(std::is_permutation(lhs.begin(), lhs.end(), expected_lhs.begin(), expected_lhs.end()));
+        EXPECT_TRUE(std::is_permutation(rhs.begin(), rhs.end(), expected_rhs.begin(), expected_rhs.end()));
+
+        // both parts stay usable trees
+        lhs.insert(-10);
+        lhs.erase(-10);
+        rhs.insert(10000);
+        rhs.erase(10000);
+
+        tree = Tree::join(std::move(lhs), std::move(rhs));
+        EXPECT_EQ(tree.size(), reference.size());
+        EXPECT_TRUE(std::is_permutation(tree.begin(), tree.end(), reference.begin(), reference.end()));
+        std::vector<int> backward(tree.rbegin(), tree.rend());
+        EXPECT_TRUE(std::is_permutation(backward.begin(), backward.end(), reference.begin(), reference.end()));
+    }
+}
+
+TEST(SplitJoin, AllPolicies) {
+    CheckSplitJoin<SearchTree<int, in_order_tag>>();
+    CheckSplitJoin<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag>>();
+    CheckSplitJoin<SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag>>();
+    CheckSplitJoin<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag, order_statistics_tag>>();
+    CheckSplitJoin<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag,
+        augments<order_statistics_tag, threaded_tag>>>();
+}
+
+TEST(SplitJoin, RelinksWithoutCopies) {
+    using Tree = SearchTree<CountedKey, in_order_tag, CountedKeyLess, std::allocator<Node<CountedKey>>, avl_tag, order_statistics_tag>;
+    std::vector<int> keys(1 << 12);
+    std::iota(keys.begin(), keys.end(), 0);
+    Tree tree(sorted_unique, keys.begin(), keys.end());
+
+    CountedKey::constructed = 0;
+    auto [lhs, rhs] = tree.split(CountedKey(1000));
+    EXPECT_EQ(CountedKey::constructed, 1);
+    EXPECT_EQ(lhs.size(), 1000u);
+    EXPECT_EQ(rhs.size(), keys.size() - 1000);
+    EXPECT_EQ(lhs.nth(999)->key, 999);
+    EXPECT_EQ(rhs.nth(0)->key, 1000);
+
+    Tree joined = Tree::join(std::move(rhs), Tree());
+    joined = Tree::join(std::move(lhs), std::move(joined));
+    EXPECT_EQ(CountedKey::constructed, 1);
+    EXPECT_EQ(joined.size(), keys.size());
+    EXPECT_EQ(joined.rank(CountedKey(3000)), 3000u);
+}
+
+long long ParallelSum(ThreadPool& pool, const std::vector<int>& values, std::size_t lhs, std::size_t rhs) {
+    if (rhs - lhs < 1000) {
+        return std::accumulate(values.begin() + lhs, values.begin() + rhs, 0LL);
+    }
+    std::size_t mid = lhs + (rhs - lhs) / 2;
+    long long left = 0;
+    long long right = 0;
+    pool.fork_join(
+        [&]() { left = ParallelSum(pool, values, lhs, mid); },
+        [&]() { right = ParallelSum(pool, values, mid, rhs); });
+
+    return left + right;
+}
+
+TEST(ThreadPool, NestedForks) {
+    ThreadPool pool(4);
+    std::vector<int> values(1 << 18);
+    std::iota(values.begin(), values.end(), 0);
+    EXPECT_EQ(ParallelSum(pool, values, 0, values.size()), std::accumulate(values.begin(), values.end(), 0LL));
+
+    // forks may also come from several outside threads at once
+    std::vector<std::thread> callers;
+    std::atomic<int> correct = 0;
+    for (int i = 0; i < 4; ++i) {
+        callers.emplace_back([&]() {
+            correct += ParallelSum(pool, values, 0, values.size()) == std::accumulate(values.begin(), values.end(), 0LL);
+        });
+    }
+    for (std::thread& caller : callers) {
+        caller.join();
+    }
+    EXPECT_EQ(correct.load(), 4);
+
+    EXPECT_THROW(pool.fork_join([]() {}, []() { throw std::runtime_error("fork"); }), std::runtime_error);
+}
+
+template <typename Tree>
+void CheckSetAlgebra(ThreadPool& pool) {
+    std::mt19937 gen(18);
+    for (int round = 0; round < 12; ++round) {
+        int range = 1 + int(gen() % 20000);
+        std::set<int> lhs;
+        std::set<int> rhs;
+        for (int i = 0; i < 5000; ++i) {
+            lhs.insert(int(gen() % range));
+        }
+        for (int i = 0, count = round % 3 ? 5000 : 40; i < count; ++i) {
+            rhs.insert(int(gen() % range));
+        }
+        Tree lhs_tree(lhs.begin(), lhs.end());
+        Tree rhs_tree(rhs.begin(), rhs.end());
+
+        std::vector<int> expected;
+        std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(expected));
+        Tree res = Tree::set_union(Tree(lhs_tree), Tree(rhs_tree), pool);
+        EXPECT_EQ(res.size(), expected.size());
+        EXPECT_TRUE(std::is_permutation(res.begin(), res.end(), expected.begin(), expected.end()));
+
+        expected.clear();
+        std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(expected));
+        res = Tree::set_intersection(Tree(lhs_tree), Tree(rhs_tree), pool);
+        EXPECT_EQ(res.size(), expected.size());
+        EXPECT_TRUE(std::is_permutation(res.begin(), res.end(), expected.begin(), expected.end()));
+
+        expected.clear();
+        std::set_difference(rhs.begin(), rhs.end(), lhs.begin(), lhs.end(), std::back_inserter(expected));
+        res = Tree::set_difference(std::move(rhs_tree), std::move(lhs_tree), pool);
+        EXPECT_EQ(res.size(), expected.size());
+        EXPECT_TRUE(std::is_permutation(res.begin(), res.end(), expected.begin(), expected.end()));
+        EXPECT_TRUE(rhs_tree.empty());
+
+        // the result is an ordinary tree
+        res.insert(-1);
+        EXPECT_EQ(res.erase(-1), 1u);
+        std::vector<int> backward(res.rbegin(), res.rend());
+        EXPECT_TRUE(std::is_permutation(backward.begin(), backward.end(), expected.begin(), expected.end()));
+    }
+}
+
+TEST(SetAlgebra, MatchesStdAlgorithms) {
+    ThreadPool pool(3);
+    CheckSetAlgebra<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag>>(pool);
+    CheckSetAlgebra<SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag, order_statistics_tag>>(pool);
+    CheckSetAlgebra<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag, threaded_tag>>(
+        ThreadPool::shared());
+}
+
+template <traversalTag Tag, typename Augment>
+void CheckParallelTraversal(ThreadPool& pool) {
+    SearchTree<std::string, Tag, std::less<std::string>, std::allocator<Node<std::string>>, avl_tag, Augment> tree;
+    std::mt19937 gen(19);
+    for (int i = 0; i < 3000; ++i) {
+        tree.insert(std::to_string(gen() % 100000));
+    }
+
+    std::string expected;
+    for (const std::string& value : tree) {
+        expected += value + ",";
+    }
+    std::string joined = tree.parallel_reduce(std::string(), std::plus<>(), [](const std::string& value) {
+        return value + ",";
+    }, pool);
+    EXPECT_EQ(joined, expected);
+
+    std::atomic<std::size_t> length = 0;
+    tree.parallel_for_each([&length](const std::string& value) {
+        length += value.size() + 1;
+    }, pool);
+    EXPECT_EQ(length.load(), expected.size());
+}
+
+TEST(ParallelTraversal, ReduceKeepsTraversalOrder) {
+    ThreadPool pool(4);
+    CheckParallelTraversal<in_order_tag, no_augment_tag>(pool);
+    CheckParallelTraversal<pre_order_tag, no_augment_tag>(pool);
+    CheckParallelTraversal<post_order_tag, no_augment_tag>(pool);
+    CheckParallelTraversal<post_order_tag, threaded_tag>(pool);
+}
+
+TEST(ParallelTraversal, SumAndEdgeCases) {
+    SearchTree<int, pre_order_tag> degenerate;
+    for (int i = 0; i < 5000; ++i) {
+        degenerate.insert(i);
+    }
+    EXPECT_EQ(degenerate.parallel_reduce(0LL, std::plus<>()), 5000LL * 4999 / 2);
+    ThreadPool pool(3);
+    EXPECT_EQ(degenerate.parallel_reduce(0LL, std::plus<>(), pool), 5000LL * 4999 / 2);
+
+    SearchTree<int, in_order_tag> empty;
+    EXPECT_EQ(empty.parallel_reduce(7, std::plus<>()), 7);
+    int calls = 0;
+    empty.parallel_for_each([&calls](int) { ++calls; });
+    EXPECT_EQ(calls, 0);
+}
+
+TEST(Serialization, SaveAndLoad) {
+    SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag> tree;
+    std::mt19937 gen(20);
+    for (int i = 0; i < 10000; ++i) {
+        tree.insert(int(gen() % 100000));
+    }
+
+    std::stringstream stream;
+    tree.save(stream);
+    auto loaded = decltype(tree)::load(stream);
+    // the loaded tree is rebuilt balanced, so only the contents match, not the post-order
+    EXPECT_EQ(loaded.size(), tree.size());
+    EXPECT_TRUE(std::is_permutation(loaded.begin(), loaded.end(), tree.begin(), tree.end()));
+
+    std::stringstream empty_stream;
+    decltype(tree)().save(empty_stream);
+    EXPECT_TRUE(decltype(tree)::load(empty_stream).empty());
+
+    std::stringstream garbage("definitely not a tree, but long enough to fill a whole header......");
+    EXPECT_THROW(decltype(tree)::load(garbage), std::runtime_error);
+    std::string bytes = stream.str();
+    std::stringstream truncated(bytes.substr(0, bytes.size() - 1));
+    EXPECT_THROW(decltype(tree)::load(truncated), std::runtime_error);
+    std::stringstream wrong_type(bytes);
+    EXPECT_THROW((SearchTree<long long, in_order_tag>::load(wrong_type)), std::runtime_error);
+}
+
+#if __has_include(<sys/mman.h>)
+TEST(Serialization, MappedTree) {
+    SearchTree<int, in_order_tag> tree;
+    for (int i = 0; i < 5000; ++i) {
+        tree.insert(i * 3);
+    }
+    std::string path = testing::TempDir() + "search_tree_mapped.bin";
+    {
+        std::ofstream out(path, std::ios::binary);
+        tree.save(out);
+    }
+
+    MappedTree<int> mapped(path);
+    EXPECT_EQ(mapped.size(), tree.size());
+    EXPECT_TRUE(std::equal(mapped.begin(), mapped.end(), tree.begin(), tree.end()));
+    EXPECT_TRUE(std::equal(mapped.rbegin(), mapped.rend(), tree.rbegin(), tree.rend()));
+    for (int value = -2; value < 15005; value += 7) {
+        EXPECT_EQ(mapped.find(value) != mapped.end(), tree.find(value) != tree.end());
+        auto lower = mapped.lower_bound(value);
+        EXPECT_EQ(lower == mapped.end() ? -1 : *lower, tree.lower_bound(value) == tree.end() ? -1 : *tree.lower_bound(value));
+    }
+
+    MappedTree<int> moved(std::move(mapped));
+    EXPECT_EQ(*moved.begin(), 0);
+    EXPECT_THROW(MappedTree<int>(path + ".missing"), std::system_error);
+    std::remove(path.c_str());
+}
+#endif
+
+TEST(Serialization, RejectsOversizedCount) {
+    // (count + 1) * sizeof(int) wraps around to 0 for the first count
+    for (std::uint64_t count : { (std::uint64_t(1) << 62) - 1, ~std::uint64_t(0) }) {
+        std::string bytes(FrozenFileHeader::size, '\0');
+        FrozenFileHeader header = FrozenFileHeader::describe<int>(count);
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        bytes.append(16, '\0');
+
+        std::istringstream in(bytes);
+        EXPECT_THROW(FrozenTree<int>::load(in), std::runtime_error);
+
+#if __has_include(<sys/mman.h>)
+        std::string path = testing::TempDir() + "search_tree_oversized.bin";
+        {
+            std::ofstream out(path, std::ios::binary);
+            out.write(bytes.data(), std::streamsize(bytes.size()));
+        }
+        EXPECT_THROW(MappedTree<int>{ path }, std::runtime_error);
+        std::remove(path.c_str());
+#endif
+    }
+}
+
+TEST(Serialization, RejectsUnsortedValues) {
+    SearchTree<int, in_order_tag> tree;
+    for (int i = 0; i < 100; ++i) {
+        tree.insert(i);
+    }
+    std::stringstream saved;
+    tree.save(saved);
+    std::string bytes = saved.str();
+
+    // swapping two stored values breaks the in-order sequence wherever they sit
+    int* values = reinterpret_cast<int*>(bytes.data() + FrozenFileHeader::size);
+    std::swap(values[1], values[50]);
+    std::istringstream in(bytes);
+    EXPECT_THROW((SearchTree<int, in_order_tag>::load(in)), std::runtime_error);
+
+    // so do duplicates
+    std::swap(values[1], values[50]);
+    values[50] = values[1];
+    std::istringstream duplicate(bytes);
+    EXPECT_THROW((SearchTree<int, in_order_tag>::load(duplicate)), std::runtime_error);
+}
+
+TEST(StreamingLoad, TextAndBinaryStreams) {
+    std::stringstream text;
+    for (int i = 0; i < 1000; ++i) {
+        text << i * 2 << '\n';
+    }
+    SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag, order_statistics_tag> tree;
+    tree.insert(sorted_unique, std::istream_iterator<int>(text), std::istream_iterator<int>());
+    EXPECT_EQ(tree.size(), 1000u);
+    EXPECT_EQ(*tree.nth(0), 0);
+    EXPECT_EQ(*tree.nth(999), 1998);
+    EXPECT_EQ(tree.rank(1000), 500u);
+    std::vector<int> forward(tree.begin(), tree.end());
+    std::vector<int> backward(tree.rbegin(), tree.rend());
+    std::reverse(backward.begin(), backward.end());
+    EXPECT_EQ(forward, backward);
+
+    std::string bytes;
+    for (long long value = 0; value < 777; ++value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    // a trailing partial value is ignored
+    bytes.push_back('x');
+    std::istringstream binary(bytes);
+    SearchTree<long long, in_order_tag, std::less<long long>, std::allocator<Node<long long>>, avl_tag> longs;
+    longs.insert(sorted_unique, BinaryStreamIterator<long long>(binary, 10), BinaryStreamIterator<long long>());
+    EXPECT_EQ(longs.size(), 777u);
+    EXPECT_EQ(*longs.begin(), 0);
+    EXPECT_EQ(*longs.rbegin(), 776);
+    longs.insert(1000);
+    EXPECT_EQ(longs.erase(500), 1u);
+    EXPECT_EQ(longs.size(), 777u);
+
+    // *it++ is the value before the step, also across a chunk boundary and at the end
+    std::istringstream again(bytes);
+    BinaryStreamIterator<long long> it(again, 4);
+    for (long long value = 0; value < 777; ++value) {
+        ASSERT_EQ(*it++, value);
+    }
+    EXPECT_EQ(it, BinaryStreamIterator<long long>());
+    static_assert(std::input_iterator<BinaryStreamIterator<long long>>);
+
+    std::istringstream empty;
+    SearchTree<int, in_order_tag> none;
+    none.insert(sorted_unique, BinaryStreamIterator<int>(empty), BinaryStreamIterator<int>());
+    EXPECT_TRUE(none.empty());
+    EXPECT_EQ(none.begin(), none.end());
+}
+
+static_assert(sizeof(SearchTree<int, in_order_tag>::iterator) == sizeof(void*));
+static_assert(sizeof(SearchTree<int, in_order_tag>) ==
+    sizeof(SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, no_balance_tag, instrumented_tag>) -
+    sizeof(std::shared_ptr<TreeCounters>));
+
+TEST(Instrumentation, CountsOperations) {
+    using Tree = SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag, instrumented_tag>;
+    Tree tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(i);
+    }
+    TreeStats stats = tree.stats();
+    EXPECT_EQ(stats.allocations, 1000u);
+    EXPECT_EQ(stats.deallocations, 0u);
+    EXPECT_GT(stats.comparisons, 0u);
+
+    tree.reset_stats();
+    EXPECT_NE(tree.find(500), tree.end());
+    stats = tree.stats();
+    // a red-black tree of 1000 nodes is at most 2 * log2(1001) deep
+    EXPECT_GE(stats.nodes_visited, 1u);
+    EXPECT_LE(stats.nodes_visited, 20u);
+    EXPECT_GE(stats.comparisons, stats.nodes_visited);
+    EXPECT_LE(stats.comparisons, 2 * stats.nodes_visited);
+
+    tree.reset_stats();
+    EXPECT_EQ(*tree.lower_bound(250), 250);
+    EXPECT_EQ(*tree.upper_bound(250), 251);
+    EXPECT_EQ(tree.stats().comparisons, tree.stats().nodes_visited);
+
+    // batched lookups count like the same lookups made one at a time
+    std::vector<int> keys = { 3, 500, 999, 1500 };
+    std::vector<Tree::iterator> found;
+    tree.reset_stats();
+    for (int key : keys) {
+        found.push_back(tree.lower_bound(key));
+    }
+    TreeStats single = tree.stats();
+    tree.reset_stats();
+    tree.lower_bound_batch(keys.begin(), keys.end(), found.begin());
+    EXPECT_EQ(tree.stats().comparisons, single.comparisons);
+    EXPECT_EQ(tree.stats().nodes_visited, single.nodes_visited);
+    tree.reset_stats();
+    tree.find_batch(keys.begin(), keys.end(), found.begin());
+    EXPECT_GT(tree.stats().comparisons, 0u);
+    EXPECT_GE(tree.stats().comparisons, tree.stats().nodes_visited);
+
+    tree.reset_stats();
+    EXPECT_EQ(std::distance(tree.begin(), tree.end()), 1000);
+    auto it = tree.end();
+    --it;
+    EXPECT_EQ(tree.stats().iterator_steps, 1001u);
+
+    Tree copy = tree;
+    EXPECT_EQ(copy.stats().allocations, 1000u);
+    EXPECT_EQ(copy.stats().iterator_steps, 0u);
+    tree.erase(500);
+    tree.clear();
+    EXPECT_EQ(tree.stats().deallocations, 1000u);
+}
+
+TEST(Instrumentation, IteratorsSurviveMoveAndSwap) {
+    using Tree = SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag, instrumented_tag>;
+    auto source = std::make_unique<Tree>();
+    for (int i = 0; i < 100; ++i) {
+        source->insert(i);
+    }
+    auto it = source->begin();
+    Tree moved(std::move(*source));
+    source.reset();
+    ++it;
+    EXPECT_EQ(moved.stats().iterator_steps, 1u);
+    EXPECT_EQ(moved.stats().allocations, 100u);
+
+    Tree other;
+    other.insert(1000);
+    auto other_it = other.begin();
+    moved.swap(other);
+    ++it;
+    ++other_it;
+    EXPECT_EQ(other_it, moved.end());
+    EXPECT_EQ(other.stats().iterator_steps, 2u);
+    EXPECT_EQ(moved.stats().iterator_steps, 1u);
+
+    auto [lhs, rhs] = other.split(50);
+    Tree().swap(other);
+    EXPECT_EQ(std::distance(lhs.begin(), lhs.end()), 50);
+    EXPECT_EQ(rhs.stats().iterator_steps, lhs.stats().iterator_steps);
+}
+
+TEST(Instrumentation, PooledAndAugmented) {
+    using Tree = SearchTree<int, pre_order_tag, std::less<int>, PoolAllocator<Node<int>>, avl_tag,
+        augments<order_statistics_tag, instrumented_tag>>;
+    std::vector<int> keys(100);
+    std::iota(keys.begin(), keys.end(), 0);
+    Tree tree(keys.begin(), keys.end());
+    EXPECT_EQ(tree.rank(42), 42u);
+    EXPECT_EQ(tree.stats().allocations, 100u);
+    tree.clear();
+    EXPECT_EQ(tree.stats().deallocations, 100u);
+}
+
+TEST(ShapeDiagnostics, ChainAndPerfectTree) {
+    EXPECT_EQ((SearchTree<int, in_order_tag>().height()), 0u);
+    EXPECT_DOUBLE_EQ((SearchTree<int, in_order_tag>().imbalance()), 1.0);
+
+    SearchTree<int, in_order_tag> chain;
+    for (int i = 0; i < 100; ++i) {
+        chain.insert(i);
+    }
+    EXPECT_EQ(chain.height(), 100u);
+    EXPECT_EQ(chain.depth_histogram(), std::vector<std::size_t>(100, 1));
+    EXPECT_DOUBLE_EQ(chain.average_path_length(), 50.5);
+    EXPECT_DOUBLE_EQ(chain.imbalance(), 100.0 / 7);
+
+    std::vector<int> keys(127);
+    std::iota(keys.begin(), keys.end(), 0);
+    SearchTree<int, pre_order_tag> perfect(sorted_unique, keys.begin(), keys.end());
+    EXPECT_EQ(perfect.height(), 7u);
+    EXPECT_EQ(perfect.depth_histogram(), (std::vector<std::size_t>{ 1, 2, 4, 8, 16, 32, 64 }));
+    EXPECT_DOUBLE_EQ(perfect.average_path_length(), 769.0 / 127);
+    EXPECT_DOUBLE_EQ(perfect.imbalance(), 1.0);
+}
+
+template <typename Tree>
+void CheckScapegoat(double depth_factor) {
+    Tree tree;
+    std::set<int> expected;
+    auto check = [&]() {
+        ASSERT_EQ(tree.size(), expected.size());
+        if (!expected.empty()) {
+            EXPECT_LE(double(tree.height() - 1), depth_factor * std::log2(double(tree.size())));
+        }
+        std::vector<int> forward(tree.begin(), tree.end());
+        std::vector<int> backward(tree.rbegin(), tree.rend());
+        std::reverse(backward.begin(), backward.end());
+        EXPECT_EQ(forward, backward);
+        EXPECT_TRUE(std::is_permutation(forward.begin(), forward.end(), expected.begin(), expected.end()));
+    };
+
+    for (int i = 0; i < 2000; ++i) {
+        tree.insert(i);
+        expected.insert(i);
+    }
+    check();
+
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> key(0, 3999);
+    for (int i = 0; i < 20000; ++i) {
+        int value = key(gen);
+        if (i % 3 == 0) {
+            EXPECT_EQ(tree.insert(value).second, expected.insert(value).second);
+        }
+        else {
+            EXPECT_EQ(tree.erase(value), expected.erase(value));
+        }
+        if (i % 1000 == 0) {
+            check();
+        }
+    }
+    check();
+
+    // a small half keeps the depth it had in the whole tree unless it is rebuilt
+    int pivot = *std::next(expected.begin(), 5);
+    auto [lhs, rhs] = tree.split(pivot);
+    EXPECT_EQ(lhs.size(), 5);
+    for (Tree* part : { &lhs, &rhs }) {
+        EXPECT_LE(double(part->height() - 1), depth_factor * std::log2(double(part->size())));
+    }
+    tree.swap(rhs);
+    tree = Tree::join(std::move(lhs), std::move(tree));
+    check();
+}
+
+TEST(ShapeDiagnostics, ScapegoatRebuilds) {
+    CheckScapegoat<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, scapegoat_tag<>>>(2);
+    CheckScapegoat<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, scapegoat_tag<3, 2>,
+        augments<order_statistics_tag, threaded_tag>>>(1.5);
+    CheckScapegoat<SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, scapegoat_tag<>, threaded_tag>>(2);
+
+    using Tree = SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, scapegoat_tag<>, order_statistics_tag>;
+    Tree tree;
+    for (int i = 0; i < 1 << 12; ++i) {
+        tree.insert(i);
+    }
+    EXPECT_LT(tree.imbalance(), 2.0);
+    for (int i = 0; i < 1 << 12; ++i) {
+        ASSERT_EQ(tree.rank(i), std::size_t(i));
+    }
+}
+
+struct WeightSum {
+    using value_type = long long;
+
+    static value_type identity() {
+        return 0;
+    }
+
+    static value_type lift(int value) {
+        return value;
+    }
+
+    static value_type combine(value_type lhs, value_type rhs) {
+        return lhs + rhs;
+    }
+};
+
+// not commutative, so it shows the order values are combined in
+struct KeyList {
+    using value_type = std::string;
+
+    static value_type identity() {
+        return {};
+    }
+
+    static value_type lift(int value) {
+        return std::to_string(value) + " ";
+    }
+
+    static value_type combine(const value_type& lhs, const value_type& rhs) {
+        return lhs + rhs;
+    }
+};
+
+template <typename Tree>
+void CheckRangeAggregate() {
+    Tree tree;
+    std::set<int> expected;
+    auto brute = [&](int lo, int hi) {
+        long long sum = 0;
+        for (auto it = expected.lower_bound(lo); it != expected.end() && *it < hi; ++it) {
+            sum += *it;
+        }
+        return sum;
+    };
+
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<int> key(0, 999);
+    for (int i = 0; i < 5000; ++i) {
+        int value = key(gen);
+        if (i % 3 == 2) {
+            tree.erase(value);
+            expected.erase(value);
+        }
+        else {
+            tree.insert(value);
+            expected.insert(value);
+        }
+        if (i % 100 == 0) {
+            int lo = key(gen);
+            int hi = key(gen);
+            ASSERT_EQ(tree.aggregate(lo, hi), brute(lo, hi));
+        }
+    }
+    EXPECT_EQ(tree.aggregate(), brute(0, 1000));
+    EXPECT_EQ(tree.aggregate(500, 500), 0);
+
+    Tree copy = tree;
+    auto [lhs, rhs] = copy.split(400);
+    EXPECT_EQ(lhs.aggregate(), brute(0, 400));
+    EXPECT_EQ(rhs.aggregate(), brute(400, 1000));
+    Tree joined = Tree::join(std::move(lhs), std::move(rhs));
+    EXPECT_EQ(joined.aggregate(100, 900), brute(100, 900));
+}
+
+TEST(RangeAggregate, MatchesBruteForce) {
+    CheckRangeAggregate<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, no_balance_tag,
+        range_aggregate<WeightSum>>>();
+    CheckRangeAggregate<SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag,
+        augments<order_statistics_tag, range_aggregate<WeightSum>, threaded_tag>>>();
+    CheckRangeAggregate<SearchTree<int, post_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag,
+        range_aggregate<WeightSum>>>();
+    CheckRangeAggregate<SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, scapegoat_tag<>,
+        augments<range_aggregate<WeightSum>, order_statistics_tag>>>();
+}
+
+TEST(RangeAggregate, CombinesInKeyOrder) {
+    using Tree = SearchTree<int, pre_order_tag, std::less<int>, std::allocator<Node<int>>, red_black_tag, range_aggregate<KeyList>>;
+    Tree tree;
+    for (int value : { 5, 1, 9, 3, 7, 2, 8, 4, 6 }) {
+        tree.insert(value);
+    }
+    EXPECT_EQ(tree.aggregate(), "1 2 3 4 5 6 7 8 9 ");
+    EXPECT_EQ(tree.aggregate(3, 8), "3 4 5 6 7 ");
+    tree.erase(5);
+    EXPECT_EQ(tree.aggregate(0, 100), "1 2 3 4 6 7 8 9 ");
+
+    auto lhs = SearchTree<int, in_order_tag, std::less<int>, std::allocator<Node<int>>, avl_tag, range_aggregate<KeyList>>();
+    auto rhs = lhs;
+    for (int i = 0; i < 20; ++i) {
+        (i % 2 ? lhs : rhs).insert(i);
+    }
+    auto both = decltype(lhs)::set_union(std::move(lhs), std::move(rhs));
+    EXPECT_EQ(both.aggregate(15, 100), "15 16 17 18 19 ");
 }
\ No newline at end of file